@@ -0,0 +1,590 @@
+// Benchmark harness for the pools against the single_list.c freelist and
+// the system malloc.
+//
+//     ./bench [--alloc=pool,adaptive,near,span,runtime,concurrent,magazine,
+//              freelist,malloc]
+//             [--workload=tree,fifo,random,prodcons,burst] [--size=16,64,256]
+//             [--ops=N] [--live=N] [--seed=N]
+//
+// Every run reports the mean ns per op over the whole run, the percentiles
+// of single ops timed on a random sample of them, the RSS the run added,
+// minor page faults, and the cache and dTLB misses per op from
+// perf_event_open when the kernel lets us.
+// Each allocated object has its first word written, so the placement of
+// objects shows up in the miss counts.
+#include "pool.hpp"
+#include "concurrent_pool.hpp"
+#include "magazine_pool.hpp"
+#include "span_source.hpp"
+#include "compacting_pool.h"
+extern "C" {
+#include "single_list.h"
+}
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+struct options {
+    vector<string> allocs = {"pool", "adaptive", "near", "span", "runtime", "concurrent",
+                             "magazine", "freelist", "malloc"};
+    vector<string> workloads = {"tree", "fifo", "random", "prodcons",
+                                "burst"};
+    vector<size_t> sizes = {16, 64, 256};
+    uint64_t ops = 4000000;
+    size_t live = 1 << 18;
+    uint64_t seed = 88172645463325252ull;
+};
+
+// Allocators. thread_safe ones may be freed into from another thread
+
+template <size_t size>
+struct pool_alloc {
+    constexpr static bool thread_safe = false;
+    base_compacting_pool<size, 8> pool;
+    void *alloc() { return pool.alloc(); }
+    void free(void *p) { pool.free(p); }
+};
+
+template <size_t size>
+struct adaptive_alloc {
+    constexpr static bool thread_safe = false;
+    base_compacting_pool<size, 8> pool;
+    adaptive_alloc() { pool.set_adaptive(true); }
+    void *alloc() { return pool.alloc(); }
+    void free(void *p) { pool.free(p); }
+};
+
+// places tree children next to their parents with alloc_near
+template <size_t size>
+struct near_alloc {
+    constexpr static bool thread_safe = false;
+    base_compacting_pool<size, 8> pool;
+    void *alloc() { return pool.alloc(); }
+    void free(void *p) { pool.free(p); }
+};
+
+template <size_t size>
+struct span_alloc {
+    constexpr static bool thread_safe = false;
+    base_compacting_pool<size, 8, span_slab_source> pool;
+    void *alloc() { return pool.alloc(); }
+    void free(void *p) { pool.free(p); }
+};
+
+template <size_t size>
+struct runtime_alloc {
+    constexpr static bool thread_safe = false;
+    compacting_pool::compacting_pool pool;
+    runtime_alloc() : pool({size, 8}) {}
+    void *alloc() { return pool.alloc(); }
+    void free(void *p) { pool.free(p); }
+};
+
+template <size_t size>
+struct concurrent_alloc {
+    constexpr static bool thread_safe = true;
+    concurrent_compacting_pool<size, 8> pool;
+    void *alloc() { return pool.alloc(); }
+    void free(void *p) { pool.free(p); }
+    void thread_done() { pool.release_thread_cache(); }
+};
+
+template <size_t size>
+struct magazine_alloc {
+    constexpr static bool thread_safe = true;
+    magazine_pool<size, 8> pool;
+    void *alloc() { return pool.alloc(); }
+    void free(void *p) { pool.free(p); }
+    void thread_done() {}
+};
+
+template <size_t size>
+struct freelist_alloc {
+    constexpr static bool thread_safe = false;
+    unfixed_block block;
+    freelist_alloc() : block(create_unfixed_block(size, 0)) {}
+    ~freelist_alloc() { destroy_unfixed_block(&block); }
+    void *alloc() { return block_alloc(&block); }
+    void free(void *p) { block_free(&block, p); }
+};
+
+template <size_t size>
+struct malloc_alloc {
+    constexpr static bool thread_safe = true;
+    void *alloc() { return ::malloc(size); }
+    void free(void *p) { ::free(p); }
+    void thread_done() {}
+};
+
+// Measurement
+
+static long perf_event_open(perf_event_attr *attr) {
+    return syscall(SYS_perf_event_open, attr, 0, -1, -1, 0);
+}
+
+struct perf_counter {
+    int fd;
+
+    perf_counter(uint32_t type, uint64_t config) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = perf_event_open(&attr);
+    }
+
+    ~perf_counter() {
+        if (fd >= 0) close(fd);
+    }
+
+    void start() {
+        if (fd < 0) return;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    // -1 when the counter isn't available
+    int64_t stop() {
+        uint64_t count;
+        if (fd < 0) return -1;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        return read(fd, &count, sizeof(count)) == sizeof(count)
+               ? (int64_t)count : -1;
+    }
+};
+
+static long rss_kb() {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static long minor_faults() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+// Times single ops, about one in sample_every of them picked at random so
+// the clock isn't read on every op and the picks don't line up with the
+// workloads' own periods. A sample runs from the end of the op before to
+// the end of the picked one, so it takes in the workload's own code in
+// between (picking a slot, writing the first word) along with the op.
+// The clock is the tsc where there is one, scaled to ns against
+// steady_clock over the run, with the cost of reading it taken off
+class sampler {
+    constexpr static uint64_t sample_every = 16;
+    vector<float> op_ticks;
+    uint64_t total = 0;
+    uint64_t until_sample;
+    uint64_t sample_start = 0;
+    uint64_t rng = 0x2545f4914f6cdd1dull;
+    uint64_t clock_cost;
+    uint64_t run_start;
+    chrono::steady_clock::time_point run_start_time;
+
+    static inline uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __builtin_ia32_rdtsc();
+#else
+        return chrono::duration_cast<chrono::nanoseconds>(
+                   chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    uint64_t next_gap() {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        return 2 + rng % (2 * sample_every - 3);
+    }
+
+public:
+    sampler() : until_sample(next_gap()) {
+        clock_cost = UINT64_MAX;
+        for (int i = 0; i < 64; i++) {
+            uint64_t start = ticks();
+            clock_cost = min(clock_cost, ticks() - start);
+        }
+        run_start_time = chrono::steady_clock::now();
+        run_start = ticks();
+    }
+
+    void op() {
+        total++;
+        if (likely(--until_sample > 1)) return;
+        uint64_t now = ticks();
+        if (until_sample == 1) {
+            // the next op is the picked one
+            sample_start = now;
+            return;
+        }
+        uint64_t spent = now - sample_start;
+        op_ticks.push_back(spent > clock_cost ? spent - clock_cost : 0);
+        until_sample = next_gap();
+    }
+
+    // ops done on other threads, which count towards the mean but aren't
+    // sampled
+    void add_unsampled(uint64_t n) { total += n; }
+
+    uint64_t ops() const { return total; }
+
+    // The sampled op latencies in ns, call once the run is done
+    vector<float> &samples() {
+        double ns = chrono::duration<double, nano>(
+                        chrono::steady_clock::now() - run_start_time).count();
+        uint64_t spent = ticks() - run_start;
+        double ns_per_tick = spent ? ns / spent : 1;
+        for (auto &t : op_ticks) t *= ns_per_tick;
+        return op_ticks;
+    }
+};
+
+static uint64_t rng_state;
+
+static inline uint64_t next_rand() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static inline void *touch(void *p) {
+    *(volatile uintptr_t *)p = (uintptr_t)p;
+    return p;
+}
+
+template <class allocator>
+void *alloc_near(allocator &a, void *) { return a.alloc(); }
+
+template <size_t size>
+void *alloc_near(near_alloc<size> &a, void *hint) {
+    return a.pool.alloc_near(hint);
+}
+
+// Workloads, each op is one alloc or one free
+
+struct node {
+    node *left, *right;
+};
+
+template <class allocator>
+node *build(allocator &a, sampler &s, int depth, node *parent = nullptr) {
+    if (depth == 0) return nullptr;
+    node *n = (node *)touch(parent ? alloc_near(a, parent) : a.alloc());
+    s.op();
+    n->left = build(a, s, depth - 1, n);
+    n->right = build(a, s, depth - 1, n);
+    return n;
+}
+
+template <class allocator>
+void destroy(allocator &a, sampler &s, node *n) {
+    if (!n) return;
+    destroy(a, s, n->left);
+    destroy(a, s, n->right);
+    a.free(n);
+    s.op();
+}
+
+// Builds and tears down small binary trees with random lifetimes
+template <class allocator>
+void tree_churn(allocator &a, sampler &s, const options &o) {
+    vector<node *> trees(o.live / 32, nullptr);
+    while (s.ops() < o.ops) {
+        uint64_t r = next_rand();
+        node *&t = trees[r % trees.size()];
+        destroy(a, s, t);
+        t = build(a, s, 1 + (r >> 32) % 6);
+    }
+    for (auto &t : trees) destroy(a, s, t);
+}
+
+// Frees objects in the order they were allocated, live at a time
+template <class allocator>
+void fifo_queue(allocator &a, sampler &s, const options &o) {
+    vector<void *> ring(o.live);
+    for (auto &p : ring) {
+        p = touch(a.alloc());
+        s.op();
+    }
+    for (size_t i = 0; s.ops() < o.ops; i = (i + 1) % ring.size()) {
+        a.free(ring[i]);
+        s.op();
+        ring[i] = touch(a.alloc());
+        s.op();
+    }
+    for (auto p : ring) a.free(p);
+}
+
+// Replaces a random one of live objects
+template <class allocator>
+void random_lifetime(allocator &a, sampler &s, const options &o) {
+    vector<void *> slots(o.live, nullptr);
+    while (s.ops() < o.ops) {
+        void *&p = slots[next_rand() % slots.size()];
+        if (p) {
+            a.free(p);
+            s.op();
+        }
+        p = touch(a.alloc());
+        s.op();
+    }
+    for (auto p : slots) {
+        if (p) a.free(p);
+    }
+}
+
+// Allocates bursts far deeper than the pool cache and frees them in
+// order, so nearly every alloc is served by a cache refill from the slab
+// bitmasks (load_all) - a micro-benchmark of the bit scans in util.hpp
+template <class allocator>
+void burst(allocator &a, sampler &s, const options &o) {
+    constexpr size_t burst_objects = 4096;
+    vector<void *> held(burst_objects);
+    while (s.ops() < o.ops) {
+        for (auto &p : held) {
+            p = a.alloc();
+            s.op();
+        }
+        for (auto p : held) {
+            a.free(p);
+            s.op();
+        }
+    }
+}
+
+// One thread allocates, another frees what it receives. The frees count
+// as ops too, they're in the timed region, but only the allocs are sampled
+template <class allocator>
+void producer_consumer(allocator &a, sampler &s, const options &o,
+                       std::true_type) {
+    constexpr size_t ring_size = 1024;
+    vector<atomic<void *>> ring(ring_size);
+    for (auto &slot : ring) slot.store(nullptr, memory_order_relaxed);
+    uint64_t to_send = o.ops / 2;
+
+    thread consumer([&] {
+        for (uint64_t i = 0; i < to_send; i++) {
+            atomic<void *> &slot = ring[i % ring_size];
+            void *p;
+            while (!(p = slot.load(memory_order_acquire))) this_thread::yield();
+            slot.store(nullptr, memory_order_relaxed);
+            a.free(p);
+        }
+        a.thread_done();
+    });
+    for (uint64_t i = 0; i < to_send; i++) {
+        atomic<void *> &slot = ring[i % ring_size];
+        while (slot.load(memory_order_acquire)) this_thread::yield();
+        slot.store(touch(a.alloc()), memory_order_release);
+        s.op();
+    }
+    consumer.join();
+    s.add_unsampled(to_send);
+    a.thread_done();
+}
+
+template <class allocator>
+void producer_consumer(allocator &, sampler &, const options &,
+                       std::false_type) {}
+
+// Running and reporting
+
+static float percentile(vector<float> &sorted, double p) {
+    if (sorted.empty()) return 0;
+    return sorted[min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+}
+
+static void print_per_op(int64_t count, uint64_t ops) {
+    if (count < 0) {
+        printf("%9s", "n/a");
+    } else {
+        printf("%9.3f", ops ? (double)count / ops : 0.0);
+    }
+}
+
+template <class allocator>
+void run(const char *alloc_name, const string &workload, size_t size,
+         const options &o) {
+    if (workload == "prodcons" && !allocator::thread_safe) return;
+
+    rng_state = o.seed;
+    // hand back what earlier runs left in the malloc heap,
+    // so every run starts from the same rss
+    malloc_trim(0);
+    perf_counter cache_misses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    perf_counter tlb_misses(PERF_TYPE_HW_CACHE,
+                            PERF_COUNT_HW_CACHE_DTLB
+                            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    long rss_before = rss_kb();
+    long faults_before = minor_faults();
+    long rss_peak;
+    sampler s;
+    {
+        allocator a;
+        cache_misses.start();
+        tlb_misses.start();
+        auto start = chrono::steady_clock::now();
+        if (workload == "tree") {
+            tree_churn(a, s, o);
+        } else if (workload == "fifo") {
+            fifo_queue(a, s, o);
+        } else if (workload == "random") {
+            random_lifetime(a, s, o);
+        } else if (workload == "burst") {
+            burst(a, s, o);
+        } else if (workload == "prodcons") {
+            producer_consumer(a, s, o,
+                              integral_constant<bool, allocator::thread_safe>());
+        }
+        auto elapsed = chrono::steady_clock::now() - start;
+        int64_t cache = cache_misses.stop();
+        int64_t tlb = tlb_misses.stop();
+        rss_peak = rss_kb();
+
+        vector<float> &samples = s.samples();
+        sort(samples.begin(), samples.end());
+        double mean = chrono::duration<double, nano>(elapsed).count()
+                      / max<uint64_t>(s.ops(), 1);
+        printf("%-10s %-8s %5zu %8.2f %8.2f %8.2f %8.2f %9.2f %8.1f %8ld",
+               alloc_name, workload.c_str(), size, mean,
+               percentile(samples, 0.5), percentile(samples, 0.9),
+               percentile(samples, 0.99), samples.empty() ? 0 : samples.back(),
+               (rss_peak - rss_before) / 1024.0,
+               minor_faults() - faults_before);
+        print_per_op(cache, s.ops());
+        print_per_op(tlb, s.ops());
+        printf("\n");
+    }
+}
+
+template <template <size_t> class allocator>
+void run_sizes(const char *name, const options &o) {
+    for (auto &workload : o.workloads) {
+        for (size_t size : o.sizes) {
+            switch (size) {
+            case 16: run<allocator<16>>(name, workload, size, o); break;
+            case 32: run<allocator<32>>(name, workload, size, o); break;
+            case 64: run<allocator<64>>(name, workload, size, o); break;
+            case 128: run<allocator<128>>(name, workload, size, o); break;
+            case 256: run<allocator<256>>(name, workload, size, o); break;
+            case 1024: run<allocator<1024>>(name, workload, size, o); break;
+            default:
+                fprintf(stderr, "size %zu isn't built in, use 16, 32, 64, "
+                                "128, 256 or 1024\n", size);
+                return;
+            }
+        }
+    }
+}
+
+static vector<string> split(const char *list) {
+    vector<string> out;
+    string item;
+    for (const char *c = list; ; c++) {
+        if (*c == ',' || !*c) {
+            if (!item.empty()) out.push_back(item);
+            item.clear();
+            if (!*c) break;
+        } else {
+            item += *c;
+        }
+    }
+    return out;
+}
+
+// A whole decimal number, anything else is a usage error
+static bool parse_number(const string &s, uint64_t &out) {
+    if (s.empty() || s[0] < '0' || s[0] > '9') return false;
+    char *end;
+    errno = 0;
+    out = strtoull(s.c_str(), &end, 10);
+    return !*end && errno != ERANGE;
+}
+
+static bool parse_args(int argc, char **argv, options &o) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *eq = strchr(arg, '=');
+        if (!eq) return false;
+        string key(arg, eq - arg);
+        const char *val = eq + 1;
+        uint64_t n;
+        if (key == "--alloc") {
+            o.allocs = split(val);
+        } else if (key == "--workload") {
+            o.workloads = split(val);
+        } else if (key == "--size") {
+            o.sizes.clear();
+            for (auto &s : split(val)) {
+                if (!parse_number(s, n)) return false;
+                o.sizes.push_back(n);
+            }
+        } else if (key == "--ops" && parse_number(val, n)) {
+            o.ops = n;
+        } else if (key == "--live" && parse_number(val, n)) {
+            o.live = max<size_t>(n, 32);
+        } else if (key == "--seed" && parse_number(val, n)) {
+            o.seed = n | 1;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    options o;
+    if (!parse_args(argc, argv, o)) {
+        fprintf(stderr, "usage: %s [--alloc=pool,adaptive,near,span,"
+                        "runtime,concurrent,magazine,freelist,malloc] "
+                        "[--workload=tree,fifo,random,prodcons,burst] "
+                        "[--size=16,64,256] [--ops=N] [--live=N] "
+                        "[--seed=N]\n", argv[0]);
+        return 1;
+    }
+    printf("bit ops: %s\n", BITOPS_BACKEND);
+    printf("%-10s %-8s %5s %8s %8s %8s %8s %9s %8s %8s %9s %9s\n",
+           "alloc", "workload", "size", "mean", "p50", "p90", "p99", "max",
+           "rss_mb", "faults", "llc/op", "dtlb/op");
+    for (auto &name : o.allocs) {
+        if (name == "pool") run_sizes<pool_alloc>("pool", o);
+        else if (name == "adaptive") run_sizes<adaptive_alloc>("adaptive", o);
+        else if (name == "near") run_sizes<near_alloc>("near", o);
+        else if (name == "span") run_sizes<span_alloc>("span", o);
+        else if (name == "runtime") run_sizes<runtime_alloc>("runtime", o);
+        else if (name == "concurrent") {
+            run_sizes<concurrent_alloc>("concurrent", o);
+        }
+        else if (name == "magazine") run_sizes<magazine_alloc>("magazine", o);
+        else if (name == "freelist") run_sizes<freelist_alloc>("freelist", o);
+        else if (name == "malloc") run_sizes<malloc_alloc>("malloc", o);
+        else fprintf(stderr, "unknown allocator %s\n", name.c_str());
+    }
+}
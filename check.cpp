@@ -0,0 +1,958 @@
+// Behavioural checks for the pools, one function per feature, covering
+// what neither test nor bench reach. Every header is included, so the
+// whole library is built too. Exits non-zero on the first check which
+// doesn't hold.
+#include "pool.hpp"
+#include "concurrent_pool.hpp"
+#include "magazine_pool.hpp"
+#include "object_pool.hpp"
+#include "pool_profile.hpp"
+#include "size_class_pool.hpp"
+#include "span_source.hpp"
+#include "compacting_pool.h"
+extern "C" {
+#include "single_list.h"
+}
+#include <limits.h>
+#include <malloc.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iterator>
+#include <list>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+#define CHECK(cond)                                                        \
+    do {                                                                   \
+        if (!(cond)) {                                                     \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,         \
+                    __LINE__, #cond);                                      \
+            exit(1);                                                       \
+        }                                                                  \
+    } while (0)
+
+// Objects freed on another thread go back to the slabs of the pool which
+// handed them out, and once the owner collects them the emptied slabs
+// are reused
+static void check_remote_frees() {
+    typedef concurrent_compacting_pool<64, 8> shared_pool;
+    shared_pool pool;
+    vector<void *> objects(100000);
+    for (auto &p : objects) p = pool.alloc();
+    CHECK(pool.retained_bytes() == 0);
+    thread other([&] {
+        for (void *p : objects) pool.free(p);
+    });
+    other.join();
+    pool.release_thread_cache();
+    size_t freed_bytes = pool.retained_bytes();
+    CHECK(freed_bytes >= objects.size() * 64);
+    for (auto &p : objects) p = pool.alloc();
+    CHECK(pool.retained_bytes() < freed_bytes / 8);
+    for (void *p : objects) pool.free(p);
+    puts("remote frees ok");
+}
+
+typedef base_compacting_pool<64, 8, malloc_slab_source, counting_pool_stats>
+    counted_pool;
+
+// alloc_bulk hands out the cached objects first and then whole runs of
+// slabs, free_bulk puts any mix of objects straight back in their slabs
+static void check_bulk() {
+    counted_pool pool;
+    void *cached = pool.alloc();
+    pool.free(cached);
+    vector<void *> objects(5000);
+    CHECK(pool.alloc_bulk(objects.data(), objects.size()) == objects.size());
+    CHECK(objects[0] == cached);
+    vector<void *> sorted = objects;
+    sort(sorted.begin(), sorted.end());
+    CHECK(unique(sorted.begin(), sorted.end()) == sorted.end());
+    for (void *p : objects) memset(p, 0xab, 64);
+
+    // every other object, out of order, then the rest in order
+    vector<void *> odd, even;
+    for (size_t i = 0; i < objects.size(); i++) {
+        (i % 2 ? odd : even).push_back(objects[i]);
+    }
+    reverse(odd.begin(), odd.end());
+    pool.free_bulk(odd.data(), odd.size());
+    pool_stats stats = pool.get_stats();
+    CHECK(stats.full_slabs == 0 && stats.empty_slabs == 0);
+    pool.free_bulk(even.data(), even.size());
+    stats = pool.get_stats();
+    CHECK(stats.allocs == objects.size() + 1);
+    CHECK(stats.frees == objects.size() + 1);
+    CHECK(stats.partial_slabs == 0 && stats.empty_slabs == 0);
+    CHECK(pool.walk_heap().live_objects == 0);
+    puts("bulk ok");
+}
+
+// The runtime sized pool rounds the size up to the alignment, hands out
+// aligned objects which don't overlap, and reuses freed ones
+static void check_runtime_pool() {
+    // slabs of 64 byte objects are no bigger than this
+    constexpr size_t max_slab_bytes = 64 * 1024;
+    compacting_pool::compacting_pool pool({40, 32});
+    CHECK(pool.object_size() == 64);
+    vector<unsigned char *> objects(20000);
+    for (size_t i = 0; i < objects.size(); i++) {
+        objects[i] = (unsigned char *)pool.alloc();
+        CHECK(objects[i] && (size_t)objects[i] % 32 == 0);
+        memset(objects[i], (int)(i & 0xff), 40);
+    }
+    for (size_t i = 0; i < objects.size(); i++) {
+        for (size_t b = 0; b < 40; b++) {
+            CHECK(objects[i][b] == (i & 0xff));
+        }
+    }
+    // the most recently freed object comes back first
+    pool.free(objects[7]);
+    CHECK(pool.alloc() == objects[7]);
+
+    // and after all of them are freed, the same slabs are used again -
+    // only the rest of the slab the first round stopped in is new
+    vector<unsigned char *> sorted = objects;
+    sort(sorted.begin(), sorted.end());
+    for (auto p : objects) pool.free(p);
+    pool.clear_cache();
+    size_t fresh = 0;
+    for (size_t i = 0; i < objects.size(); i++) {
+        objects[i] = (unsigned char *)pool.alloc();
+        fresh += !binary_search(sorted.begin(), sorted.end(), objects[i]);
+    }
+    CHECK(fresh < max_slab_bytes / 64);
+    for (auto p : objects) pool.free(p);
+    pool.clear_cache();
+    pool.clean();
+    puts("runtime pool ok");
+}
+
+// Fully free slabs stay with the pool until they are scavenged, oldest
+// first and down to the slabs asked to be kept, or a retained limit is set
+static void check_scavenge() {
+    counted_pool pool;
+    vector<void *> objects(20000);
+    for (auto &p : objects) p = pool.alloc();
+    for (void *p : objects) pool.free(p);
+    pool.clear_cache();
+    size_t kept = pool.free_slabs();
+    pool_stats stats = pool.get_stats();
+    CHECK(stats.partial_slabs == 0 && stats.empty_slabs == 0);
+    CHECK(stats.full_slabs == kept && kept > 16);
+
+    CHECK(pool.scavenge(2) == 2);
+    CHECK(pool.free_slabs() == kept - 2);
+    CHECK(pool.scavenge(kept, 4) == kept - 6);
+    CHECK(pool.free_slabs() == 4);
+    CHECK(pool.scavenge_for(chrono::seconds(1), 1) == 3);
+    CHECK(pool.free_slabs() == 1);
+
+    // released slabs come back from the source in working order
+    pool.set_retained_limit(2);
+    for (auto &p : objects) {
+        p = pool.alloc();
+        memset(p, 0xcd, 64);
+    }
+    for (void *p : objects) pool.free(p);
+    pool.clear_cache();
+    CHECK(pool.free_slabs() == 2);
+    pool.set_retained_limit(0);
+    CHECK(pool.free_slabs() == 0);
+    CHECK(pool.get_stats().bytes_retained == 0);
+    puts("scavenge ok");
+}
+
+// A span keeps the pages of released slabs while other slabs still use
+// it, and gives the whole span back once the last one is released
+static void check_span_decommit() {
+    constexpr size_t slab_bytes = 16384;
+    constexpr size_t page = 4096;
+    for (huge_pages mode : {huge_pages::none, huge_pages::hugetlb}) {
+        span_slab_source source(mode);
+        vector<char *> slabs(8);
+        for (auto &s : slabs) {
+            s = (char *)source.acquire_slab(slab_bytes);
+            CHECK(s);
+            memset(s, 0x5a, slab_bytes);
+        }
+        source.release_slab(slabs[3], slab_bytes);
+        unsigned char resident[slab_bytes / page];
+        CHECK(mincore(slabs[3], slab_bytes, resident) == 0);
+        for (unsigned char r : resident) CHECK(r & 1);
+        CHECK(source.acquire_slab(slab_bytes) == slabs[3]);
+        for (char *s : slabs) source.release_slab(s, slab_bytes);
+        if (mode == huge_pages::none) {
+            CHECK(mincore(slabs[3], slab_bytes, resident) == 0);
+            for (unsigned char r : resident) CHECK(!(r & 1));
+        }
+        // the spare comes back zeroed and usable
+        char *again = (char *)source.acquire_slab(slab_bytes);
+        CHECK(again);
+        memset(again, 0x5a, slab_bytes);
+        source.release_slab(again, slab_bytes);
+    }
+    puts("span decommit ok");
+}
+
+struct item {
+    size_t index;
+    char pad[56];
+};
+
+typedef base_compacting_pool<sizeof(item), 8> item_pool;
+
+// the handles of the live items, by index, which the relocator keeps
+// pointing at wherever their items are moved
+static void relocate_item(void *from, void *to, void *context) {
+    vector<item *> &handles = *(vector<item *> *)context;
+    size_t index = ((item *)from)->index;
+    CHECK(handles[index] == from);
+    memcpy(to, from, sizeof(item));
+    handles[index] = (item *)to;
+}
+
+// Compaction empties sparse slabs a little at a time, and objects freed
+// into the cache between calls of a pass are never taken for live ones
+static void check_compact() {
+    item_pool pool;
+    vector<item *> handles(100000);
+    for (size_t i = 0; i < handles.size(); i++) {
+        handles[i] = (item *)pool.alloc();
+        handles[i]->index = i;
+    }
+    // leave every slab sparse
+    for (size_t i = 0; i < handles.size(); i++) {
+        if (i % 8) {
+            pool.free(handles[i]);
+            handles[i] = nullptr;
+        }
+    }
+    pool.clear_cache();
+    size_t slabs_before = pool.walk_heap().slabs - pool.free_slabs();
+    pool.set_relocator(relocate_item, &handles);
+    size_t moved = 0;
+    size_t calls = 0;
+    size_t next_free = 0;
+    while (size_t n = pool.compact(200)) {
+        CHECK(n <= 200);
+        moved += n;
+        // a dead object in the cache, and a live one freed into it
+        pool.free(pool.alloc());
+        next_free = (next_free + 7919) % handles.size();
+        while (!handles[next_free]) {
+            next_free = (next_free + 1) % handles.size();
+        }
+        pool.free(handles[next_free]);
+        handles[next_free] = nullptr;
+        calls++;
+    }
+    CHECK(calls > 1 && moved > 0);
+    CHECK(pool.walk_heap().slabs - pool.free_slabs() < slabs_before / 4);
+    for (size_t i = 0; i < handles.size(); i++) {
+        if (handles[i]) CHECK(handles[i]->index == i);
+    }
+    for (item *p : handles) {
+        if (p) pool.free(p);
+    }
+    pool.clear_cache();
+    CHECK(pool.walk_heap().live_objects == 0);
+    puts("compact ok");
+}
+
+typedef base_compacting_pool<64, 8, malloc_slab_source,
+                             sampling_pool_stats<counting_pool_stats>>
+    sampled_pool;
+
+// A region hands out distinct objects from slabs of its own, and gives
+// them all back at once - counted as frees, dropped from the heap profile,
+// and with the slabs reused by the next region
+static void check_region() {
+    heap_profiler &profiler = heap_profiler::get();
+    profiler.set_sample_period(4096);
+    sampled_pool pool;
+    vector<void *> objects(10000);
+    {
+        sampled_pool::region r(pool);
+        for (auto &p : objects) {
+            p = r.alloc();
+            CHECK(p && (size_t)p % 8 == 0);
+            memset(p, 0x3c, 64);
+        }
+        vector<void *> sorted = objects;
+        sort(sorted.begin(), sorted.end());
+        CHECK(unique(sorted.begin(), sorted.end()) == sorted.end());
+        CHECK(profiler.live_samples() > 0);
+    }
+    pool_stats stats = pool.get_stats();
+    CHECK(stats.allocs == objects.size());
+    CHECK(stats.frees == objects.size());
+    CHECK(profiler.live_samples() == 0);
+    CHECK(pool.walk_heap().live_objects == 0);
+    CHECK(pool.free_slabs() == stats.slabs_created);
+
+    sampled_pool::region again(pool);
+    for (size_t i = 0; i < objects.size(); i++) CHECK(again.alloc());
+    again.release_all();
+    stats = pool.get_stats();
+    CHECK(stats.slabs_created == pool.free_slabs());
+    CHECK(stats.allocs == stats.frees);
+    profiler.set_sample_period(heap_profiler::default_period);
+    puts("region ok");
+}
+
+typedef base_compacting_pool<64, 8> pool_64;
+
+// A heap walk visits exactly the live objects, cached ones left out, and
+// gives the same report whether it runs in one go or a few slabs at a
+// time, interleaved with another walk or with the pool in use
+static void check_walk_heap() {
+    pool_64 pool;
+    vector<void *> live;
+    for (size_t i = 0; i < 50000; i++) live.push_back(pool.alloc());
+    for (size_t i = 0; i < live.size(); i += 3) {
+        pool.free(live[i]);
+        live[i] = nullptr;
+    }
+    size_t num_live = live.size() - (live.size() + 2) / 3;
+    heap_report full = pool.walk_heap();
+    CHECK(full.live_objects == num_live);
+    CHECK(full.bytes_live == num_live * 64);
+    // the ring and the object on top of it
+    CHECK(full.cached_objects == pool.cache_depth() + 1);
+    size_t histogram = 0;
+    for (size_t n : full.density) histogram += n;
+    CHECK(histogram == full.slabs);
+    CHECK(full.bytes_fragmented > 0);
+
+    // spread over many calls, alongside a second walk
+    pool_64::heap_walk walk, other;
+    vector<void *> visited;
+    auto visit = [&](void *p) { visited.push_back(p); };
+    bool done = false, other_done = false;
+    while (!done || !other_done) {
+        if (!done) done = pool.walk_heap(walk, 7, visit);
+        if (!other_done) other_done = pool.walk_heap(other, 5);
+    }
+    CHECK(walk.report.slabs == full.slabs);
+    CHECK(other.report.slabs == full.slabs);
+    CHECK(other.report.live_objects == full.live_objects);
+    vector<void *> expected;
+    for (void *p : live) {
+        if (p) expected.push_back(p);
+    }
+    sort(expected.begin(), expected.end());
+    sort(visited.begin(), visited.end());
+    CHECK(visited == expected);
+
+    // and with the lists changing under a paused walk
+    pool_64::heap_walk churned;
+    size_t i = 0;
+    while (!pool.walk_heap(churned, 3)) {
+        void *&p = live[i++ % live.size()];
+        if (p) {
+            pool.free(p);
+            p = nullptr;
+        } else {
+            p = pool.alloc();
+        }
+    }
+    CHECK(churned.report.slabs <= full.slabs + i);
+    for (void *p : live) {
+        if (p) pool.free(p);
+    }
+    pool.clear_cache();
+    CHECK(pool.walk_heap().live_objects == 0);
+    puts("walk_heap ok");
+}
+
+// Retired objects stay out of use while a thread which was pinned when
+// they were retired is still pinned, and come back to the pool once it
+// leaves its epoch
+static void check_epochs() {
+    typedef concurrent_compacting_pool<64, 8> shared_pool;
+    shared_pool pool;
+    vector<void *> objects(1000);
+    for (auto &p : objects) p = pool.alloc();
+
+    atomic<bool> pinned(false), done(false);
+    thread reader([&] {
+        shared_pool::epoch_guard guard(pool);
+        pinned = true;
+        while (!done) this_thread::yield();
+    });
+    while (!pinned) this_thread::yield();
+    for (void *p : objects) pool.retire(p);
+    for (int i = 0; i < 10; i++) CHECK(pool.collect_retired() == 0);
+    done = true;
+    reader.join();
+
+    size_t freed = 0;
+    for (int i = 0; i < 10 && freed < objects.size(); i++) {
+        freed += pool.collect_retired();
+    }
+    CHECK(freed == objects.size());
+    // and, with the cache put back in the slabs, they are among the
+    // first objects the pool hands out again - the slabs also had a few
+    // objects loaded into the cache ahead which weren't handed out
+    pool.release_thread_cache();
+    vector<void *> again(objects.size() + 64);
+    for (auto &p : again) p = pool.alloc();
+    sort(objects.begin(), objects.end());
+    sort(again.begin(), again.end());
+    CHECK(includes(again.begin(), again.end(), objects.begin(), objects.end()));
+    for (void *p : again) pool.free(p);
+    puts("epochs ok");
+}
+
+// The magazine pool hands out distinct objects to threads sharing it,
+// takes freed ones back through the depot and hands them out again, and
+// drain moves the depot's objects to the slabs
+static void check_magazines() {
+    constexpr size_t rounds = 32;
+    constexpr size_t n = 10000;
+    // objects on other CPUs' magazines aren't reachable from this one
+    size_t held = 2 * rounds * max<long>(sysconf(_SC_NPROCESSORS_CONF), 1);
+    magazine_pool<64, 8, rounds> pool(n / rounds + 8);
+
+    vector<vector<size_t *>> per_thread(4);
+    vector<thread> threads;
+    for (size_t t = 0; t < per_thread.size(); t++) {
+        threads.emplace_back([&, t] {
+            for (size_t i = 0; i < n / 4; i++) {
+                size_t *p = (size_t *)pool.alloc();
+                CHECK(p && (size_t)p % 8 == 0);
+                *p = t;
+                per_thread[t].push_back(p);
+            }
+        });
+    }
+    for (auto &th : threads) th.join();
+    vector<void *> objects;
+    for (size_t t = 0; t < per_thread.size(); t++) {
+        for (size_t *p : per_thread[t]) {
+            CHECK(*p == t);
+            objects.push_back(p);
+        }
+    }
+    sort(objects.begin(), objects.end());
+    CHECK(unique(objects.begin(), objects.end()) == objects.end());
+
+    for (void *p : objects) pool.free(p);
+    vector<void *> again(n);
+    for (auto &p : again) p = pool.alloc();
+    sort(again.begin(), again.end());
+    vector<void *> reused;
+    set_intersection(again.begin(), again.end(), objects.begin(),
+                     objects.end(), back_inserter(reused));
+    CHECK(reused.size() + held >= n);
+
+    for (void *p : again) pool.free(p);
+    size_t drained = pool.drain();
+    CHECK(drained <= n && drained + held >= n);
+    CHECK(pool.drain() == 0);
+    puts("magazines ok");
+}
+
+// The counters follow every alloc, free, eviction and refill, the slab
+// lists add up to the bytes retained, and the occupancy histogram sorts
+// the partial slabs by how full they are. Without counting the pool
+// carries no counters at all
+static void check_stats() {
+    counted_pool pool;
+    constexpr size_t per_slab = counted_pool::objects_per_slab;
+    vector<void *> objects(per_slab * 10);
+    for (auto &p : objects) p = pool.alloc();
+    pool_stats stats = pool.get_stats();
+    CHECK(stats.allocs == objects.size() && stats.frees == 0);
+    CHECK(stats.refills > 0 && stats.cache_hits < stats.allocs);
+    CHECK(stats.slabs_created >= 10 && stats.slabs_created <= 11);
+    CHECK(stats.empty_slabs >= 9);
+    CHECK(stats.bytes_retained
+          == (stats.empty_slabs + stats.partial_slabs + stats.full_slabs)
+                 * counted_pool::slab_bytes);
+
+    // every free past what the ring holds evicts one
+    for (void *p : objects) pool.free(p);
+    stats = pool.get_stats();
+    CHECK(stats.frees == objects.size());
+    CHECK(stats.evictions >= objects.size() - pool.cache_depth() - 1);
+    CHECK(stats.evictions <= objects.size());
+    uint64_t hits = stats.cache_hits;
+    for (size_t i = 0; i < pool.cache_depth(); i++) objects[i] = pool.alloc();
+    CHECK(pool.get_stats().cache_hits == hits + pool.cache_depth());
+    for (size_t i = 0; i < pool.cache_depth(); i++) pool.free(objects[i]);
+
+    // a bit over half of every slab left in use, so the slabs handed out
+    // in full all land in the third of four buckets
+    pool.clear_cache();
+    map<size_t, vector<void *>> by_slab;
+    for (auto &p : objects) {
+        p = pool.alloc();
+        by_slab[(size_t)p & ~(counted_pool::slab_bytes - 1)].push_back(p);
+    }
+    size_t half_full = 0;
+    for (auto &slab : by_slab) {
+        vector<void *> &in_slab = slab.second;
+        half_full += in_slab.size() == per_slab;
+        while (in_slab.size() > per_slab / 2 + 1) {
+            pool.free(in_slab.back());
+            in_slab.pop_back();
+        }
+    }
+    pool.clear_cache();
+    stats = pool.get_stats();
+    size_t histogram[4];
+    pool.occupancy_histogram(histogram);
+    CHECK(histogram[0] + histogram[1] + histogram[2] + histogram[3]
+          == stats.partial_slabs);
+    CHECK(half_full >= 9 && histogram[2] >= half_full);
+    CHECK(stats.bytes_free == stats.full_slabs * counted_pool::slab_bytes);
+    for (auto &slab : by_slab) {
+        for (void *p : slab.second) pool.free(p);
+    }
+
+    base_compacting_pool<64, 8> plain;
+    plain.free(plain.alloc());
+    stats = plain.get_stats();
+    CHECK(stats.allocs == 0 && stats.frees == 0);
+    CHECK(stats.empty_slabs + stats.partial_slabs + stats.full_slabs == 1);
+    CHECK(sizeof(plain) < sizeof(pool));
+    puts("stats ok");
+}
+
+// The cache holds its depth plus the object on top before it evicts, a
+// smaller depth keeps the most recently freed objects, and an adaptive
+// pool grows the cache under bursts and shrinks it as the pool drains
+static void check_cache_depth() {
+    counted_pool pool;
+    CHECK(pool.cache_depth() == counted_pool::default_cache_depth);
+    pool.set_cache_depth(100);
+    CHECK(pool.cache_depth() == 128);
+    pool.set_cache_depth(1);
+    CHECK(pool.cache_depth() == counted_pool::min_cache_depth);
+    pool.set_cache_depth(100000);
+    CHECK(pool.cache_depth() == counted_pool::max_cache_depth);
+
+    vector<void *> objects(20000);
+    for (size_t depth : {8, 32, 256}) {
+        pool.set_cache_depth(depth);
+        for (size_t i = 0; i < depth + 2; i++) objects[i] = pool.alloc();
+        pool.clear_cache();
+        uint64_t evictions = pool.get_stats().evictions;
+        for (size_t i = 0; i <= depth; i++) pool.free(objects[i]);
+        CHECK(pool.get_stats().evictions == evictions);
+        pool.free(objects[depth + 1]);
+        CHECK(pool.get_stats().evictions == evictions + 1);
+        pool.clear_cache();
+    }
+
+    pool.set_cache_depth(64);
+    for (size_t i = 0; i < 65; i++) objects[i] = pool.alloc();
+    for (size_t i = 0; i < 65; i++) pool.free(objects[i]);
+    pool.set_cache_depth(8);
+    for (size_t i = 65; i-- > 56;) CHECK(pool.alloc() == objects[i]);
+    pool.clear_cache();
+
+    // bursts run off both ends of the cache
+    pool.set_adaptive(true);
+    for (int round = 0; round < 50; round++) {
+        for (size_t i = 0; i < 300; i++) objects[i] = pool.alloc();
+        for (size_t i = 0; i < 300; i++) pool.free(objects[i]);
+    }
+    CHECK(pool.cache_depth() == counted_pool::max_cache_depth);
+    // and a pool which only frees has no use for it
+    for (auto &p : objects) p = pool.alloc();
+    for (void *p : objects) pool.free(p);
+    CHECK(pool.cache_depth() == counted_pool::min_cache_depth);
+    puts("cache depth ok");
+}
+
+// alloc_near takes the open object closest to the hint in the hint's own
+// slab, and falls back to alloc when that slab is full or there's no hint
+static void check_alloc_near() {
+    counted_pool pool;
+    constexpr size_t per_slab = counted_pool::objects_per_slab;
+    map<size_t, vector<void *>> by_slab;
+    for (size_t i = 0; i < per_slab * 3; i++) {
+        void *p = pool.alloc();
+        by_slab[(size_t)p & ~(counted_pool::slab_bytes - 1)].push_back(p);
+    }
+    vector<void *> *full = nullptr;
+    for (auto &slab : by_slab) {
+        if (slab.second.size() == per_slab) full = &slab.second;
+    }
+    CHECK(full);
+    vector<void *> &in_slab = *full;
+    sort(in_slab.begin(), in_slab.end());
+    pool.free(in_slab[10]);
+    pool.free(in_slab[40]);
+    pool.free(in_slab[41]);
+    pool.clear_cache();
+    uint64_t allocs = pool.get_stats().allocs;
+    size_t empty = pool.get_stats().empty_slabs;
+    CHECK(pool.alloc_near(in_slab[12]) == in_slab[10]);
+    CHECK(pool.alloc_near(in_slab[43]) == in_slab[41]);
+    CHECK(pool.alloc_near(in_slab[20]) == in_slab[40]);
+    CHECK(pool.get_stats().allocs == allocs + 3);
+    // the last open object made the slab full again
+    CHECK(pool.get_stats().empty_slabs == empty + 1);
+
+    void *fallback = pool.alloc_near(in_slab[0]);
+    CHECK(fallback && ((size_t)fallback & ~(counted_pool::slab_bytes - 1))
+                          != ((size_t)in_slab[0]
+                              & ~(counted_pool::slab_bytes - 1)));
+    void *plain = pool.alloc_near(nullptr);
+    CHECK(plain && plain != fallback);
+    CHECK(pool.get_stats().allocs == allocs + 5);
+    pool.free(fallback);
+    pool.free(plain);
+    for (auto &slab : by_slab) {
+        for (void *p : slab.second) pool.free(p);
+    }
+    pool.clear_cache();
+    CHECK(pool.walk_heap().live_objects == 0);
+    puts("alloc_near ok");
+}
+
+// The freelist baseline carves its aligned slabs lazily, and a hint gets
+// a free chunk or fresh memory from the hint's own slab when there is one
+// at hand, and an ordinary chunk otherwise
+static void check_block_alloc_hint() {
+    unfixed_block blk = create_unfixed_block(48, 0);
+    CHECK(blk.unit_num >= 64);
+    CHECK((blk.slab_bytes & (blk.slab_bytes - 1)) == 0);
+    size_t units = blk.unit_num;
+    auto slab_of = [&](void *p) { return (size_t)p & ~(blk.slab_bytes - 1); };
+
+    // two full slabs and the start of a third
+    vector<char *> chunks(units * 2 + 10);
+    for (auto &p : chunks) {
+        p = (char *)block_alloc(&blk);
+        CHECK(p && slab_of(p) == slab_of(p + blk.data_size - 1));
+    }
+    vector<char *> sorted = chunks;
+    sort(sorted.begin(), sorted.end());
+    CHECK(unique(sorted.begin(), sorted.end()) == sorted.end());
+    CHECK(slab_of(chunks[units - 1]) != slab_of(chunks[units]));
+    CHECK(slab_of(chunks[units]) == slab_of(chunks[2 * units - 1]));
+    size_t bumping = slab_of(chunks.back());
+
+    char *freed = chunks[5];
+    block_free(&blk, freed);
+    // the free chunk is in another slab, so fresh memory in the hint's
+    char *fresh = (char *)block_alloc_hint(&blk, chunks[2 * units + 1]);
+    CHECK(fresh != freed && slab_of(fresh) == bumping);
+    // and it is in this one
+    CHECK(block_alloc_hint(&blk, chunks[1]) == freed);
+    // nothing at hand in the hint's slab
+    block_free(&blk, chunks[units + 3]);
+    CHECK(block_alloc_hint(&blk, chunks[7]) == chunks[units + 3]);
+    CHECK(slab_of(block_alloc_hint(&blk, nullptr)) == bumping);
+    CHECK(destroy_unfixed_block(&blk) == 3);
+    puts("block_alloc_hint ok");
+}
+
+#if defined(COMPACTING_POOL_HARDENED)
+// Runs misuse in a child and expects the pool to stop it with what in
+// its message
+template <class misuse>
+static void expect_fault(const char *what, misuse run) {
+    int out[2];
+    CHECK(pipe(out) == 0);
+    pid_t child = fork();
+    CHECK(child >= 0);
+    if (child == 0) {
+        dup2(out[1], 2);
+        run();
+        _exit(0);
+    }
+    close(out[1]);
+    string message;
+    char buf[256];
+    ssize_t got;
+    while ((got = read(out[0], buf, sizeof(buf))) > 0) message.append(buf, got);
+    close(out[0]);
+    int status;
+    CHECK(waitpid(child, &status, 0) == child);
+    CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+    CHECK(message.find(what) != string::npos);
+}
+
+// A hardened pool stops on double frees, whether the object is still
+// cached or back in its slab, on frees of pointers it never handed out
+// and on writes to freed objects
+static void check_hardened() {
+    expect_fault("double free", [] {
+        pool_64 pool;
+        void *p = pool.alloc();
+        pool.free(p);
+        pool.free(p);
+    });
+    expect_fault("double free", [] {
+        pool_64 pool;
+        void *p = pool.alloc();
+        pool.free(p);
+        pool.clear_cache();
+        pool.free(p);
+    });
+    expect_fault("isn't from a pool slab", [] {
+        pool_64 pool;
+        void *foreign;
+        CHECK(posix_memalign(&foreign, pool_64::slab_bytes,
+                             pool_64::slab_bytes) == 0);
+        memset(foreign, 0, pool_64::slab_bytes);
+        pool.free((char *)foreign + 256);
+    });
+    expect_fault("another pool", [] {
+        pool_64 pool, other;
+        other.free(pool.alloc());
+    });
+    expect_fault("isn't an object", [] {
+        pool_64 pool;
+        pool.free((char *)pool.alloc() + 8);
+    });
+    expect_fault("written after it was freed", [] {
+        pool_64 pool;
+        char *p = (char *)pool.alloc();
+        pool.free(p);
+        p[3] = 1;
+        pool.alloc();
+    });
+    puts("hardened ok");
+}
+#endif
+
+// Every size gets a class at least as big, aligned to the class size's
+// largest power of two, and a freed object is the next one handed out
+static void check_size_classes() {
+    typedef size_class_pool<span_slab_source> class_pool;
+    class_pool pool;
+    for (size_t bytes = 0; bytes <= class_pool::max_size; bytes++) {
+        void *p = pool.alloc(bytes);
+        size_t cls = pool.class_of(bytes);
+        CHECK(p && class_pool::usable_size(p) == pool.class_size(cls));
+        CHECK(pool.class_size(cls) >= bytes);
+        CHECK(cls == 0 || pool.class_size(cls - 1) < bytes);
+        CHECK(pool.class_of_object(p) == cls);
+        CHECK((size_t)p % class_pool::alignment_of(pool.class_size(cls)) == 0);
+        memset(p, 0x5a, bytes);
+        pool.free(p);
+        CHECK(pool.alloc(bytes) == p);
+        pool.free(p);
+    }
+    CHECK(!pool.alloc(class_pool::max_size + 1));
+
+    for (size_t align = 32; align <= 1024; align *= 2) {
+        for (size_t bytes = 1; bytes <= class_pool::max_size; bytes += 37) {
+            size_t cls = pool.class_of(bytes, align);
+            void *p = pool.alloc(bytes, align);
+            if (cls == class_pool::num_classes) {
+                CHECK(!p);
+                continue;
+            }
+            CHECK(p && (size_t)p % align == 0);
+            CHECK(class_pool::usable_size(p) >= bytes);
+            pool.free(p);
+        }
+    }
+    CHECK(pool.class_size(pool.class_of(48, 64)) == 64);
+    CHECK(!pool.alloc(16, 2 * class_pool::max_class_align));
+    pool.clear_cache();
+    pool.clean();
+    puts("size classes ok");
+}
+
+// Run in a copy of this program with the malloc shim preloaded
+static void check_preloaded_shim() {
+    // glibc would give 24 bytes
+    void *small = malloc(20);
+    CHECK(malloc_usable_size(small) == 32);
+    free(small);
+    CHECK(malloc(20) == small);
+    free(small);
+
+    for (size_t bytes = 1; bytes < (1 << 20); bytes = bytes * 5 / 4 + 1) {
+        unsigned char *p = (unsigned char *)malloc(bytes);
+        CHECK(p && (size_t)p % 16 == 0 && malloc_usable_size(p) >= bytes);
+        memset(p, 0x77, bytes);
+        p = (unsigned char *)realloc(p, bytes * 2);
+        CHECK(p && p[bytes - 1] == 0x77);
+        free(p);
+        p = (unsigned char *)calloc(bytes, 1);
+        CHECK(p && p[bytes - 1] == 0);
+        free(p);
+    }
+
+    // small alignments come from the classes, not a mapping of their own
+    void *p;
+    CHECK(posix_memalign(&p, 64, 48) == 0);
+    CHECK((size_t)p % 64 == 0 && malloc_usable_size(p) == 64);
+    free(p);
+    p = aligned_alloc(128, 200);
+    CHECK((size_t)p % 128 == 0 && malloc_usable_size(p) == 256);
+    free(p);
+    for (size_t align = 32; align <= (1 << 16); align *= 2) {
+        for (size_t bytes = 1; bytes < (1 << 19); bytes = bytes * 3 + 1) {
+            CHECK(posix_memalign(&p, align, bytes) == 0);
+            CHECK((size_t)p % align == 0 && malloc_usable_size(p) >= bytes);
+            memset(p, 0x11, bytes);
+            free(p);
+        }
+    }
+
+    // a fork while another thread holds a class lock must not leave the
+    // child stuck on it
+    volatile bool stop = false;
+    thread churn([&] {
+        while (!stop) free(malloc(64));
+    });
+    for (int i = 0; i < 200; i++) {
+        pid_t child = fork();
+        CHECK(child >= 0);
+        if (child == 0) {
+            alarm(10);
+            free(malloc(64));
+            _exit(0);
+        }
+        int status;
+        CHECK(waitpid(child, &status, 0) == child);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    stop = true;
+    churn.join();
+}
+
+// Runs check_preloaded_shim in a copy of this program with the shim from
+// next to it preloaded
+static void check_shim(const char *self) {
+    char path[PATH_MAX];
+    if (!realpath(self, path)) {
+        puts("shim skipped, can't find this program");
+        return;
+    }
+    string so(path);
+    so = so.substr(0, so.rfind('/') + 1) + "libcompacting_malloc.so";
+    if (access(so.c_str(), R_OK)) {
+        puts("shim skipped, libcompacting_malloc.so isn't built");
+        return;
+    }
+    fflush(stdout);
+    pid_t child = fork();
+    CHECK(child >= 0);
+    if (child == 0) {
+        setenv("LD_PRELOAD", so.c_str(), 1);
+        execl(path, path, "--preloaded-shim", (char *)nullptr);
+        _exit(127);
+    }
+    int status;
+    CHECK(waitpid(child, &status, 0) == child);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    puts("shim ok");
+}
+
+struct tagged {};
+
+struct point {
+    static int live;
+    int x, y;
+    point(int x_, int y_) : x(x_), y(y_) { live++; }
+    ~point() { live--; }
+};
+
+int point::live = 0;
+
+static void check_object_pool() {
+    point *p = object_pool<point>::make(1, 2);
+    CHECK(p && p->x == 1 && p->y == 2 && point::live == 1);
+    object_pool<point>::destroy(p);
+    CHECK(point::live == 0);
+    object_pool<point>::destroy(nullptr);
+
+    // a tag gives the same type a pool of its own
+    typedef object_pool<point, tagged> tagged_points;
+    CHECK((void *)&object_pool<point>::pool() != (void *)&tagged_points::pool());
+    point *q = tagged_points::make(3, 4);
+    pool_stats stats = tagged_points::pool().get_stats();
+    CHECK(stats.partial_slabs + stats.empty_slabs == 1);
+    tagged_points::destroy(q);
+
+    list<int, pool_allocator<int>> numbers;
+    for (int i = 0; i < 1000; i++) numbers.push_back(i);
+    typedef pool_allocator<pair<const int, int>> pair_allocator;
+    map<int, int, less<int>, pair_allocator> squares;
+    for (int i : numbers) squares[i] = i * i;
+    CHECK(squares[31] == 961);
+    numbers.remove_if([](int i) { return i % 2; });
+    CHECK(numbers.size() == 500 && numbers.front() == 0);
+    puts("object_pool ok");
+}
+
+static void check_profile() {
+    heap_profiler &profiler = heap_profiler::get();
+    profiler.set_sample_period(4096);
+    vector<void *> objects(100000);
+    {
+        base_compacting_pool<64, 8, malloc_slab_source,
+                             sampling_pool_stats<counting_pool_stats>> pool;
+        for (auto &p : objects) p = pool.alloc();
+        // about one in 64 objects is sampled
+        size_t sampled = profiler.live_samples();
+        CHECK(sampled > objects.size() / 128 && sampled < objects.size() / 32);
+
+        FILE *out = tmpfile();
+        CHECK(out && profiler.write_profile(out));
+        rewind(out);
+        char line[256];
+        CHECK(fgets(line, sizeof(line), out));
+        CHECK(strstr(line, "heap profile:") == line);
+        CHECK(strstr(line, "@ heap_v2/4096"));
+        fclose(out);
+
+        for (void *p : objects) pool.free(p);
+        CHECK(profiler.live_samples() == 0);
+    }
+    profiler.set_sample_period(heap_profiler::default_period);
+    puts("profile ok");
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && !strcmp(argv[1], "--preloaded-shim")) {
+        check_preloaded_shim();
+        return 0;
+    }
+    check_remote_frees();
+    check_bulk();
+    check_runtime_pool();
+    check_scavenge();
+    check_span_decommit();
+    check_compact();
+    check_region();
+    check_walk_heap();
+    check_epochs();
+    check_magazines();
+    check_stats();
+    check_cache_depth();
+    check_alloc_near();
+    check_block_alloc_hint();
+#if defined(COMPACTING_POOL_HARDENED)
+    check_hardened();
+#endif
+    check_size_classes();
+    check_shim(argv[0]);
+    check_object_pool();
+    check_profile();
+    return 0;
+}
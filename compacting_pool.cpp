@@ -4,8 +4,8 @@
 
 #define noinline __attribute__ ((noinline))
 
-namepsace compacting_pool {
-namepsace compacting_pool_helpers {
+namespace compacting_pool {
+namespace compacting_pool_helpers {
 
     // Many of these functions are forcibly made not-inline because
     // inlining them would increase icache usage for a fairly small
@@ -15,75 +15,171 @@ namepsace compacting_pool_helpers {
 
     // These functions are also called in a way to minimize or even nullify the extra code
 
-    slab_meta *create_slab(uint32_t size, uint32_t align) {
+    slab_layout make_layout(size_align sa) {
+        // cached objects hold the lru links
+        size_t align = sa.align > (int32_t)alignof(object_meta)
+                       ? sa.align : alignof(object_meta);
+        size_t size = sa.size > sizeof(object_meta) ? sa.size : sizeof(object_meta);
+        size_t stride = pool_geometry::round_up(size, align);
+
+        slab_layout layout;
+        layout.slab_bytes = pool_geometry::slab_bytes(stride, align, false);
+        layout.stride = stride;
+        layout.stride_inverse = (uint32_t)(((uint64_t)1 << 32) / stride
+                                           + (((uint64_t)1 << 32) % stride != 0));
+        layout.objects = pool_geometry::objects_in(layout.slab_bytes, stride,
+                                                   align, false);
+        layout.words = pool_geometry::mask_words(layout.slab_bytes, stride,
+                                                 align, false);
+        layout.objects_offset = pool_geometry::header_bytes(layout.words,
+                                                            align, false);
+        return layout;
+    }
 
+    static inline size_t *open_bitmask(slab_meta *s) {
+        return (size_t *)(s + 1);
     }
 
-    static noinline void remove_from_double_list(slab_meta *&list_head,
-                                                 slab_meta *toret) {
-        if (toret == list_head) {
-            // in the case where there's only one element,
-            // the following operations are a no-op. But I figure it's better
-            // to keep an entry out of the branch predictor table
-            // w/o a big increase in code size
-            list_head = (toret == toret->next) ? nullptr : toret->next;
-        }
-        toret->next->prev = toret->prev;
-        toret->prev->next = toret->next;
+    static inline char *members(slab_meta *s, const slab_layout &layout) {
+        return (char *)s + layout.objects_offset;
     }
 
-    static noinline void add_to_double_list(slab_meta *&list_head,
-                                            slab_meta *toret) {
-        if (list_head) {
-            // avoid extra loads/stores from aliasing
-            slab_meta *cur_head = list_head;
-            toret->next = cur_head;
-            toret->prev = curret->prev;
-            curret->prev->next = toret;
-            cur_head->prev = toret;
-        }
-        else {
-            toret->next = toret->prev = toret;
-            list_head = toret;
+    static noinline slab_meta *create_slab(slab_meta **slabs,
+                                           const slab_layout &layout,
+                                           void *owner) {
+        slab_meta *s = (slab_meta *)malloc_slab_source().acquire_slab(layout.slab_bytes);
+        if (!s) {
+            return nullptr;
         }
+        s->owner = owner;
+        s->num_open = layout.objects;
+        s->object_size = layout.stride;
+        slab_bits::init(open_bitmask(s), layout.words, layout.objects);
+        slab_list::push_front(s, slabs[full_list]);
+        return s;
     }
 
-    slab_meta *select_list_dump(slab_meta ** slabs, size_align align) {
-        slab_meta *&empty_head = slabs[0];
-        slab_meta *&partial_head = slabs[1];
-        slab_meta *&full_head = slabs[2];
-
-        // This set of branch *might* be compressible by transforming the boolean
-        // into selection from a jump table. Not sure if that would confuse or help
-        // the branch predictor or how much more valuable space in the
-        // indirect branch predictor is...
-        if (align.align > 0) {
-            if (full_head) {
-                goto get_full_slab;
+    noinline void return_to_slab(slab_meta **slabs, const slab_layout &layout,
+                                 void *obj) {
+        slab_meta *s = (slab_meta *)((size_t)obj & ~(layout.slab_bytes - 1));
+        uint64_t offset = (char *)obj - members(s, layout);
+        size_t index = (offset * layout.stride_inverse) >> 32;
+        bool was_empty = s->num_open == 0;
+        slab_bits::put(open_bitmask(s), index);
+        ++s->num_open;
+
+        // Only have one branch on the main path
+        if (unlikely(was_empty | (s->num_open == layout.objects))) {
+            // empty slabs go to bottom of the partial list,
+            // full slabs to the top of the full list
+            if (was_empty) {
+                slab_list::remove(s, slabs[empty_list]);
+                slab_list::push_back(s, slabs[partial_list]);
             }
-            else if (partial_head) {
-                goto get_partial_slab;
+            else {
+                slab_list::remove(s, slabs[partial_list]);
+                slab_list::push_front(s, slabs[full_list]);
             }
         }
-        else {
-            if (full_head) {
-                goto get_full_slab;
-            }
-            else if (partial_head) {
-                goto get_partial_slab;
-            }
+    }
+
+    // Picks the slab to refill the cache from - partially used slabs first,
+    // so that the fully free ones can be released, then free slabs, and
+    // finally a new slab. The chosen slab is moved to the partial list
+    slab_meta *select_list_dump(slab_meta **slabs, const slab_layout &layout,
+                                void *owner) {
+        slab_meta *&partial_head = slabs[partial_list];
+        slab_meta *&full_head = slabs[full_list];
+
+        if (partial_head) {
+            return partial_head;
         }
+        slab_meta *s = full_head ? full_head
+                                 : create_slab(slabs, layout, owner);
+        if (s) {
+            slab_list::remove(s, full_head);
+            slab_list::push_front(s, partial_head);
+        }
+        return s;
+    }
 
-        goto create_slab;
-        // Gotos are bad!! except when they prevent gcc from blindly duplicating
-        // almost identical code in a million different places to avoid a jump or a register mov
+    void release_slab_list(slab_meta *&list, const slab_layout &layout) {
+        slab_meta *s = list;
+        list = nullptr;
+        if (!s) return;
+        s->prev->next = nullptr;
+        while (s) {
+            slab_meta *tofree = s;
+            s = s->next;
+            malloc_slab_source().release_slab(tofree, layout.slab_bytes);
+        }
+    }
 
-    get_partial_slab:
+} // namespace compacting_pool_helpers
 
-    get_full_slab:
+using namespace compacting_pool_helpers;
+
+compacting_pool::compacting_pool(size_align align)
+    : head(&sentinel), occupancy(0), layout(make_layout(align)) {
+    sentinel.next = sentinel.prev = &sentinel;
+    slabs[empty_list] = slabs[partial_list] = slabs[full_list] = nullptr;
+}
+
+compacting_pool::~compacting_pool() {
+    clear_cache();
+    release_slab_list(slabs[empty_list], layout);
+    release_slab_list(slabs[partial_list], layout);
+    release_slab_list(slabs[full_list], layout);
+}
+
+// Loads up to cache_size objects from one slab into the cache
+// and returns one more - the cache is empty when this is called
+noinline void *compacting_pool::refill() {
+    slab_meta *s = select_list_dump(slabs, layout, this);
+    if (!s) {
+        return nullptr;
+    }
+    size_t *words = open_bitmask(s);
+    char *base = members(s, layout);
+    void *rval = base + slab_bits::take_first(words, layout.words) * layout.stride;
+    --s->num_open;
+
+    uint32_t to_load = s->num_open < (uint32_t)cache_size ? s->num_open
+                                                          : cache_size;
+    s->num_open -= to_load;
+    occupancy = to_load;
+    for (size_t w = 0; to_load; w++) {
+        size_t available_set = words[w];
+        while (available_set && to_load) {
+            size_t index = w * pool_geometry::bits_per_word
+                         + get_and_clear_first_set(&available_set);
+            object_meta *obj = (object_meta *)(base + index * layout.stride);
+            obj->prev = head;
+            head->next = obj;
+            head = obj;
+            --to_load;
+        }
+        words[w] = available_set;
+    }
 
-    create_slab:
+    if (s->num_open == 0) {
+        slab_list::remove(s, slabs[partial_list]);
+        slab_list::push_front(s, slabs[empty_list]);
+    }
+    return rval;
+}
+
+void compacting_pool::clear_cache() {
+    while (head != &sentinel) {
+        object_meta *obj = head;
+        head = obj->prev;
+        return_to_slab(slabs, layout, obj);
     }
+    occupancy = 0;
+}
+
+void compacting_pool::clean() {
+    release_slab_list(slabs[full_list], layout);
+}
 
-} // namespace compacting_pool_helpers
 } // namespace compacting_pool
@@ -2,21 +2,25 @@
 #define COMPACTING_POOL_H
 
 #include <stdint.h>
+#include "slab.hpp"
 
 
-// A compacting pool for 64 bit intel machines
-// Support for different platforms in-progress
+// A compacting pool for 64 bit machines, util.hpp picks the bit scans
+// for x86-64 (with or without BMI1) and aarch64
+//
+// This is the runtime-sized sibling of base_compacting_pool. It uses the
+// same slabs (slab.hpp), but the size and alignment are constructor
+// arguments, so dozens of size classes share one copy of the code.
+// Instead of the ringbuffer, freed objects are cached on an intrusive
+// doubly linked LRU list threaded through the objects themselves.
 namespace compacting_pool {
 namespace compacting_pool_helpers {
 
     struct object_meta {
         object_meta *next, *prev;
-    }
+    };
 
-    struct slab_meta {
-        uint64_t open_mask;
-        slab_meta *prev, *next;
-    }
+    typedef slab_header slab_meta;
 
     // This is a more compact representation
     // of the alignment info when passing as a parameter
@@ -25,37 +29,52 @@ namespace compacting_pool_helpers {
         int32_t align;
     };
 
-} // namespace compacting_pool_helpers
+    // Slab geometry for one size class, computed once at construction
+    struct slab_layout {
+        size_t slab_bytes;
+        uint32_t stride;
+        // ceil(2^32 / stride), turns the index division into a multiply
+        uint32_t stride_inverse;
+        uint32_t objects;
+        uint32_t words;
+        uint32_t objects_offset;
+    };
 
-// Would be best to have evict_default not result
-// in different sets of slabs, but oh well. probably not a big deal
+    // indices into the slab list array
+    constexpr int empty_list = 0;
+    constexpr int partial_list = 1;
+    constexpr int full_list = 2;
 
-template<unsigned char sz>
-class compacting_pool {
-    struct dummy_object {
-        union {
-            object_meta ometa; // also provides alignment properties
-            char data[sz];
-        }
-    }
+    slab_layout make_layout(size_align align);
 
-    struct slab {
-        dummy_object members[64];
-        slab_meta smeta;
-    };
+    void return_to_slab(slab_meta **slabs, const slab_layout &layout,
+                        void *obj);
+
+    slab_meta *select_list_dump(slab_meta **slabs, const slab_layout &layout,
+                                void *owner);
+
+    void release_slab_list(slab_meta *&list, const slab_layout &layout);
+
+} // namespace compacting_pool_helpers
+
+class compacting_pool {
+    typedef compacting_pool_helpers::object_meta object_meta;
+    typedef compacting_pool_helpers::slab_meta slab_meta;
 
     // important that this is the first element
     // so the compare in alloc is directly compared to this
     object_meta sentinel;
     object_meta *head;
     int occupancy;
+    compacting_pool_helpers::slab_layout layout;
+    slab_meta *slabs[3];
 
     // This is more expensive, but does a better job of preserving the cache
     void free_evict(object_meta *toret) {
         toret->prev = head;
         head->next = toret;
         head = toret;
-        if (occupancy < 32) {
+        if (occupancy < cache_size) {
             ++occupancy;
         }
         else {
@@ -64,7 +83,7 @@ class compacting_pool {
             object_meta *new_tail = old_tail->next;
             sentinel.next = new_tail;
             new_tail->prev = &sentinel;
-            // get rid of old_tail;
+            compacting_pool_helpers::return_to_slab(slabs, layout, old_tail);
         }
     }
 
@@ -72,32 +91,38 @@ class compacting_pool {
     // recently-usedness of the cache. Probably better for mass freeing if
     // cpu time spent in the pool is an issue
     void free_noevict(object_meta *toret) {
-        if (occupancy < 32) {
+        if (occupancy < cache_size) {
             ++occupancy;
             toret->prev = head;
             head->next = toret;
             head = toret;
         }
         else {
-            // load head to make sure it's in the cache
-            (volatile object_meta *)head->next;
-            // return toret to the cache
-            //...
+            compacting_pool_helpers::return_to_slab(slabs, layout, toret);
         }
     }
 
+    void *refill();
+
 public:
 
+    constexpr static bool evict_default = true;
+    constexpr static int cache_size = 32;
+
+    explicit compacting_pool(compacting_pool_helpers::size_align align);
+    ~compacting_pool();
+
+    compacting_pool(const compacting_pool &) = delete;
+    compacting_pool &operator=(const compacting_pool &) = delete;
+
     void *alloc() {
         object_meta *rval = head;
-        if (rval != &sentinel) {
-            ++occupancy;
+        if (likely(rval != &sentinel)) {
+            --occupancy;
             head = rval->prev;
             return rval;
         }
-        else {
-            // get new object
-        }
+        return refill();
     }
 
     template<bool evict = evict_default>
@@ -105,6 +130,14 @@ public:
         object_meta *meta = (object_meta *)toret;
         evict ? free_evict(meta) : free_noevict(meta);
     }
+
+    // Returns every cached object to its slab
+    void clear_cache();
+
+    // Releases the slabs which have no allocated objects
+    void clean();
+
+    size_t object_size() const { return layout.stride; }
 };
 
 } // namespace compacting_pool
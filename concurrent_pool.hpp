@@ -0,0 +1,565 @@
+#ifndef CONCURRENT_POOL_HPP
+#define CONCURRENT_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "pool.hpp"
+
+/// A thread-safe pool built from one base_compacting_pool per thread.
+///
+/// Each thread allocates and frees through its own ring-buffer cache and
+/// slab lists, exactly like the single threaded pool, so the hot path has
+/// no atomics. The threads only meet at the slab level:
+///
+/// 1. A slab that becomes completely free on eviction goes to a shared
+///    depot, and a thread that runs out of slabs takes one from the depot
+///    before asking malloc. The depot is a lock-free stack tagged with the
+///    low bits of the (slab-aligned) pointers to avoid ABA.
+///
+/// 2. An object freed by a thread that doesn't own its slab is cached
+///    by the freeing thread like any other object. Only when it is evicted
+///    from that cache is it returned, with a fetch_or on the slab's remote
+///    bitmask. The slab is queued on its owner the first time, and the
+///    owner merges the remote bits when it next refills.
+///
+/// On NUMA machines there is one depot per node. A thread takes slabs from
+/// its own node's depot before trying the others, releases slabs into it,
+/// and new slabs are carved from spans of that node, each bound to it with
+/// a single mbind when it's mapped, so a thread keeps reusing memory from
+/// its own socket. A thread looks its node up again on every slab it
+/// takes, not on the way back.
+///
+/// Free slabs stay in the depot until scavenge() moves them to a cold list,
+/// which keeps the memory but gives its pages back to the kernel with
+/// madvise - the slabs are never unmapped while threads may still read
+/// them through the lock-free stack. background_scavenger does this on
+/// a timer.
+///
+/// Lock-free structures can't free a node which other threads may still be
+/// reading. Readers bracket their accesses with an epoch_guard instead, and
+/// the node is retire()d into a per-thread bag. Once every pinned thread
+/// has seen the global epoch move on twice, the whole bag goes back to the
+/// slab bitmasks with free_bulk.
+///
+/// A thread's cache is parked when the thread exits and handed to the next
+/// thread which uses the pool. The pool has to outlive any thread that is
+/// still using it, but threads may exit after the pool is destroyed.
+template <size_t size, size_t align>
+class concurrent_compacting_pool {
+
+  struct depot_source {
+    constexpr static bool shared_slabs = true;
+    constexpr static size_t min_slab_bytes = pool_geometry::min_slab_bytes;
+
+    concurrent_compacting_pool* depot;
+    size_t node;
+
+    void* acquire_slab(size_t bytes) {
+      node = depot->local_node();
+      void* s = depot->pop_nearest(node);
+      s = s ? s : depot->take_cold(node);
+      return s ? s : depot->fresh_slab(bytes, node);
+    }
+
+    // the node of the last slab taken, the thread most likely still runs
+    // there and this slab was most likely taken there too
+    void release_slab(void* s, size_t) {
+      depot->push_slab(node, s);
+    }
+  };
+
+  typedef base_compacting_pool<size, align, depot_source> local_pool;
+
+  constexpr static uintptr_t tag_mask = local_pool::slab_bytes - 1;
+
+  // retired objects are bagged by the epoch they were retired in, and
+  // a bag is safe to free once the global epoch is two past it
+  constexpr static size_t num_bags = 3;
+  constexpr static size_t retire_batch = 64;
+  constexpr static uint64_t quiescent = 0;
+
+  struct thread_cache {
+    local_pool pool;
+    concurrent_compacting_pool* owner;
+    std::atomic<uint32_t> refs;
+    std::atomic<bool> in_use;
+    std::atomic<bool> orphaned;
+    thread_cache* next_cache;
+
+    // the epoch this thread is pinned in, or quiescent
+    std::atomic<uint64_t> pinned_epoch;
+    uint32_t pin_depth;
+    uint64_t bag_epochs[num_bags];
+    std::vector<void*> bags[num_bags];
+
+    thread_cache(concurrent_compacting_pool* parent)
+      : pool(depot_source{parent, 0}), owner(parent), refs(2),
+        in_use(true), orphaned(false), next_cache(nullptr),
+        pinned_epoch(quiescent), pin_depth(0), bag_epochs() {}
+
+    void free_bag(size_t bag) {
+      std::vector<void*>& objects = bags[bag];
+      // sorted, runs of objects from one slab are freed together
+      std::sort(objects.begin(), objects.end());
+      pool.free_bulk(objects.data(), objects.size());
+      objects.clear();
+    }
+  };
+
+  /// The caches a thread holds, keyed by pool id since a pool
+  /// can be destroyed and another created at the same address
+  struct cache_table {
+    constexpr static size_t slots = 16;
+    uint64_t ids[slots] = {};
+    thread_cache* caches[slots] = {};
+    size_t next_victim = 0;
+
+    ~cache_table() {
+      for (auto cache : caches) {
+        if (cache) release_cache(cache);
+      }
+    }
+  };
+
+  static cache_table& local_table() {
+    static thread_local cache_table table;
+    return table;
+  }
+
+  static std::atomic<uint64_t>& id_counter() {
+    static std::atomic<uint64_t> counter(0);
+    return counter;
+  }
+
+  constexpr static size_t max_nodes = 8;
+
+  const uint64_t id;
+
+  // a tagged stack of free slabs, padded so nodes don't share a line
+  struct node_depot {
+    std::atomic<uintptr_t> free_slabs;
+    char pad[64 - sizeof(std::atomic<uintptr_t>)];
+
+    node_depot() : free_slabs(0) {}
+  };
+
+  node_depot depots[max_nodes];
+
+  // fresh slabs on NUMA machines are carved from spans bound to a node,
+  // and the spans are only unmapped with the pool
+  constexpr static size_t node_span_bytes =
+    local_pool::slab_bytes > ((size_t)2 << 20) ? local_pool::slab_bytes
+                                               : (size_t)2 << 20;
+
+  struct node_spans {
+    std::mutex lock;
+    char* next = nullptr;
+    char* end = nullptr;
+    std::vector<void*> mapped;
+  };
+
+  node_spans spans[max_nodes];
+  const size_t num_nodes;
+  std::atomic<size_t> num_free;
+  std::atomic<thread_cache*> caches;
+
+  // decommitted slabs, only touched on the slow path
+  std::mutex cold_lock;
+  std::vector<void*> cold_slabs;
+  std::atomic<size_t> num_cold;
+
+  std::atomic<uint64_t> global_epoch;
+
+  size_t local_node() const {
+    return num_nodes > 1 ? current_numa_node() % num_nodes : 0;
+  }
+
+  void* pop_slab(size_t node) {
+    std::atomic<uintptr_t>& free_slabs = depots[node].free_slabs;
+    uintptr_t head = free_slabs.load(std::memory_order_acquire);
+    while (true) {
+      void* s = (void*)(head & ~tag_mask);
+      if (!s) return nullptr;
+      // s may be popped and reused under us, the tag makes the cas fail then
+      void* next = __atomic_load_n((void**)s, __ATOMIC_RELAXED);
+      uintptr_t new_head = (uintptr_t)next | ((head + 1) & tag_mask);
+      if (free_slabs.compare_exchange_weak(head, new_head,
+                                           std::memory_order_acquire)) {
+        num_free.fetch_sub(1, std::memory_order_relaxed);
+        return s;
+      }
+    }
+  }
+
+  void push_slab(size_t node, void* s) {
+    std::atomic<uintptr_t>& free_slabs = depots[node].free_slabs;
+    uintptr_t head = free_slabs.load(std::memory_order_relaxed);
+    uintptr_t new_head;
+    do {
+      __atomic_store_n((void**)s, (void*)(head & ~tag_mask), __ATOMIC_RELAXED);
+      new_head = (uintptr_t)s | ((head + 1) & tag_mask);
+    } while (!free_slabs.compare_exchange_weak(head, new_head,
+                                               std::memory_order_release));
+    num_free.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // node's own depot first, then the others in order
+  void* pop_nearest(size_t node) {
+    for (size_t i = 0; i < num_nodes; i++) {
+      void* s = pop_slab((node + i) % num_nodes);
+      if (s) return s;
+    }
+    return nullptr;
+  }
+
+  // single node machines keep using malloc, with NUMA the span is mapped
+  // directly so the preference applies before any page is touched
+  void* fresh_slab(size_t bytes, size_t node) {
+    if (num_nodes == 1) {
+      return malloc_slab_source().acquire_slab(bytes);
+    }
+    node_spans& span = spans[node];
+    std::lock_guard<std::mutex> guard(span.lock);
+    if (span.next == span.end) {
+      void* p = map_aligned(node_span_bytes, node_span_bytes);
+      if (!p) return nullptr;
+      prefer_numa_node(p, node_span_bytes, node);
+      span.mapped.push_back(p);
+      span.next = (char*)p;
+      span.end = span.next + node_span_bytes;
+    }
+    void* s = span.next;
+    span.next += bytes;
+    return s;
+  }
+
+  // slabs carved from node spans go with their span
+  void release_fresh(void* s) {
+    if (num_nodes == 1) {
+      malloc_slab_source().release_slab(s, slab_bytes);
+    }
+  }
+
+  void* take_cold(size_t node) {
+    if (!num_cold.load(std::memory_order_relaxed)) return nullptr;
+    std::lock_guard<std::mutex> guard(cold_lock);
+    if (cold_slabs.empty()) return nullptr;
+    void* s = cold_slabs.back();
+    cold_slabs.pop_back();
+    num_cold.fetch_sub(1, std::memory_order_relaxed);
+    // decommitted, so the pages come back on the new node
+    if (num_nodes > 1) prefer_numa_node(s, slab_bytes, node);
+    return s;
+  }
+
+  static void release_cache(thread_cache* cache) {
+    if (!cache->orphaned.load(std::memory_order_acquire)) {
+      cache->owner->collect_bags(cache);
+      cache->pool.clear_cache();
+      cache->pool.collect_remote();
+      cache->in_use.store(false, std::memory_order_release);
+    }
+    if (cache->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete cache;
+    }
+  }
+
+  __attribute__ ((noinline)) thread_cache* attach_cache(cache_table& table);
+
+  bool try_advance_epoch(uint64_t epoch);
+  size_t collect_bags(thread_cache* cache);
+
+  thread_cache* local_cache() {
+    cache_table& table = local_table();
+    for (size_t i = 0; i < cache_table::slots; i++) {
+      if (likely(table.ids[i] == id)) return table.caches[i];
+    }
+    return attach_cache(table);
+  }
+
+public:
+
+  void* alloc() { return local_cache()->pool.alloc(); }
+
+  void free(void* to_ret) { local_cache()->pool.free(to_ret); }
+
+  /// Flushes the calling thread's cache and parks it for another thread.
+  /// Retired objects whose grace period is over are freed first, the rest
+  /// stay bagged until a thread picks the cache up and collects them
+  void release_thread_cache();
+
+  /// Pins the calling thread in the current epoch, so nothing retired
+  /// from now on is freed until it calls exit_epoch. Pins nest
+  void enter_epoch();
+
+  void exit_epoch();
+
+  /// Frees obj once every thread pinned at the time has left its epoch.
+  /// obj must already be unreachable for threads which pin after this
+  void retire(void* obj);
+
+  /// Moves the epoch on if no pinned thread holds it back and frees the
+  /// calling thread's retired objects whose grace period is over, which
+  /// retire() otherwise only does on a later retire. Meant for threads
+  /// which stop retiring, returns how many objects were freed
+  size_t collect_retired() { return collect_bags(local_cache()); }
+
+  /// Keeps the calling thread pinned for its lifetime
+  class epoch_guard {
+    concurrent_compacting_pool& pool;
+
+  public:
+    explicit epoch_guard(concurrent_compacting_pool& pool_) : pool(pool_) {
+      pool.enter_epoch();
+    }
+
+    epoch_guard(const epoch_guard&) = delete;
+    epoch_guard& operator=(const epoch_guard&) = delete;
+
+    ~epoch_guard() { pool.exit_epoch(); }
+  };
+
+  constexpr static size_t slab_bytes = local_pool::slab_bytes;
+
+  /// Decommits up to max_slabs free slabs from the depot, leaving
+  /// keep_slabs ready for reuse, and returns how many it decommitted
+  size_t scavenge(size_t max_slabs, size_t keep_slabs = 0);
+
+  /// Scavenges in small batches until the depot is down to keep_slabs
+  /// or budget has run out
+  size_t scavenge_for(std::chrono::nanoseconds budget, size_t keep_slabs = 0);
+
+  /// Bytes of free slabs still holding memory in the depot
+  size_t retained_bytes() const {
+    return num_free.load(std::memory_order_relaxed) * slab_bytes;
+  }
+
+  concurrent_compacting_pool()
+    : id(++id_counter()),
+      num_nodes(numa_node_count() < max_nodes ? numa_node_count() : max_nodes),
+      num_free(0), caches(nullptr),
+      num_cold(0), global_epoch(1) {}
+
+  ~concurrent_compacting_pool();
+};
+
+template<size_t si, size_t a>
+typename concurrent_compacting_pool<si, a>::thread_cache*
+concurrent_compacting_pool<si, a>::attach_cache(cache_table& table) {
+  size_t slot = 0;
+  while (slot < cache_table::slots && table.caches[slot]) ++slot;
+  if (slot == cache_table::slots) {
+    slot = table.next_victim;
+    table.next_victim = (slot + 1) % cache_table::slots;
+    release_cache(table.caches[slot]);
+  }
+
+  thread_cache* cache = caches.load(std::memory_order_acquire);
+  for (; cache; cache = cache->next_cache) {
+    bool parked = false;
+    if (cache->in_use.compare_exchange_strong(parked, true,
+                                              std::memory_order_acquire)) {
+      cache->refs.fetch_add(1, std::memory_order_relaxed);
+      break;
+    }
+  }
+  if (!cache) {
+    cache = new thread_cache(this);
+    thread_cache* head = caches.load(std::memory_order_relaxed);
+    do {
+      cache->next_cache = head;
+    } while (!caches.compare_exchange_weak(head, cache,
+                                           std::memory_order_release));
+  }
+  table.ids[slot] = id;
+  table.caches[slot] = cache;
+  return cache;
+}
+
+template<size_t si, size_t a>
+void concurrent_compacting_pool<si, a>::release_thread_cache() {
+  cache_table& table = local_table();
+  for (size_t i = 0; i < cache_table::slots; i++) {
+    if (table.ids[i] == id) {
+      release_cache(table.caches[i]);
+      table.ids[i] = 0;
+      table.caches[i] = nullptr;
+    }
+  }
+}
+
+template<size_t si, size_t a>
+void concurrent_compacting_pool<si, a>::enter_epoch() {
+  thread_cache* cache = local_cache();
+  if (cache->pin_depth++) return;
+  uint64_t epoch = global_epoch.load(std::memory_order_seq_cst);
+  // the pin has to be visible before the epoch is read again, or the
+  // epoch could move on twice between the load and the store
+  while (true) {
+    cache->pinned_epoch.store(epoch, std::memory_order_seq_cst);
+    uint64_t now = global_epoch.load(std::memory_order_seq_cst);
+    if (now == epoch) return;
+    epoch = now;
+  }
+}
+
+template<size_t si, size_t a>
+void concurrent_compacting_pool<si, a>::exit_epoch() {
+  thread_cache* cache = local_cache();
+  if (--cache->pin_depth) return;
+  cache->pinned_epoch.store(quiescent, std::memory_order_release);
+}
+
+template<size_t si, size_t a>
+void concurrent_compacting_pool<si, a>::retire(void* obj) {
+  thread_cache* cache = local_cache();
+  uint64_t epoch = global_epoch.load(std::memory_order_seq_cst);
+  size_t bag = epoch % num_bags;
+  if (cache->bag_epochs[bag] != epoch) {
+    for (size_t i = 0; i < num_bags; i++) {
+      if (cache->bag_epochs[i] + 2 <= epoch && !cache->bags[i].empty()) {
+        cache->free_bag(i);
+      }
+    }
+    cache->bag_epochs[bag] = epoch;
+  }
+  cache->bags[bag].push_back(obj);
+  if (cache->bags[bag].size() % retire_batch == 0) {
+    try_advance_epoch(epoch);
+  }
+}
+
+template<size_t si, size_t a>
+bool concurrent_compacting_pool<si, a>::try_advance_epoch(uint64_t epoch) {
+  thread_cache* c = caches.load(std::memory_order_acquire);
+  for (; c; c = c->next_cache) {
+    uint64_t pinned = c->pinned_epoch.load(std::memory_order_seq_cst);
+    if (pinned != quiescent && pinned != epoch) return false;
+  }
+  return global_epoch.compare_exchange_strong(epoch, epoch + 1,
+                                              std::memory_order_seq_cst);
+}
+
+template<size_t si, size_t a>
+size_t concurrent_compacting_pool<si, a>::collect_bags(thread_cache* cache) {
+  uint64_t epoch = global_epoch.load(std::memory_order_seq_cst);
+  // two steps are enough to free every bag, unless another thread is
+  // pinned in an older epoch
+  for (int step = 0; step < 2 && try_advance_epoch(epoch); step++) {
+    epoch++;
+  }
+  size_t freed = 0;
+  for (size_t i = 0; i < num_bags; i++) {
+    if (cache->bag_epochs[i] + 2 <= epoch && !cache->bags[i].empty()) {
+      freed += cache->bags[i].size();
+      cache->free_bag(i);
+    }
+  }
+  return freed;
+}
+
+template<size_t si, size_t a>
+size_t concurrent_compacting_pool<si, a>::scavenge(size_t max_slabs,
+                                                   size_t keep_slabs) {
+  size_t released = 0;
+  while (released < max_slabs
+         && num_free.load(std::memory_order_relaxed) > keep_slabs) {
+    void* s = pop_nearest(0);
+    if (!s) break;
+    decommit(s, slab_bytes);
+    std::lock_guard<std::mutex> guard(cold_lock);
+    cold_slabs.push_back(s);
+    num_cold.fetch_add(1, std::memory_order_relaxed);
+    ++released;
+  }
+  return released;
+}
+
+template<size_t si, size_t a>
+size_t concurrent_compacting_pool<si, a>::scavenge_for(
+    std::chrono::nanoseconds budget, size_t keep_slabs) {
+  constexpr size_t batch = 8;
+  auto deadline = std::chrono::steady_clock::now() + budget;
+  size_t released = 0;
+  size_t got;
+  do {
+    got = scavenge(batch, keep_slabs);
+    released += got;
+  } while (got == batch && std::chrono::steady_clock::now() < deadline);
+  return released;
+}
+
+template<size_t si, size_t a>
+concurrent_compacting_pool<si, a>::~concurrent_compacting_pool() {
+  thread_cache* all = caches.load(std::memory_order_acquire);
+  // evicting from one cache can free into any other cache's slabs,
+  // so every cache is emptied before any slabs are released
+  for (thread_cache* c = all; c; c = c->next_cache) c->pool.clear_cache();
+  for (thread_cache* c = all; c; c = c->next_cache) c->pool.reset();
+  while (void* s = pop_nearest(0)) {
+    release_fresh(s);
+  }
+  for (void* s : cold_slabs) {
+    release_fresh(s);
+  }
+  for (node_spans& span : spans) {
+    for (void* p : span.mapped) munmap(p, node_span_bytes);
+  }
+  while (all) {
+    thread_cache* c = all;
+    all = all->next_cache;
+    c->orphaned.store(true, std::memory_order_release);
+    if (c->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete c;
+    }
+  }
+}
+
+/// Keeps the depot of a concurrent_compacting_pool under retained_bytes
+/// from a background thread, decommitting at most batch slabs per period
+/// so a spike is given back gradually. Must be destroyed before the pool
+template <class pool_type>
+class background_scavenger {
+  pool_type& pool;
+  std::mutex lock;
+  std::condition_variable wake;
+  bool stopping = false;
+  std::thread worker;
+
+  void run(size_t keep_slabs, std::chrono::milliseconds period,
+           size_t batch) {
+    std::unique_lock<std::mutex> guard(lock);
+    while (!wake.wait_for(guard, period, [this] { return stopping; })) {
+      pool.scavenge(batch, keep_slabs);
+    }
+  }
+
+public:
+
+  background_scavenger(pool_type& pool_, size_t retained_bytes,
+                       std::chrono::milliseconds period
+                         = std::chrono::milliseconds(10),
+                       size_t batch = 64)
+    : pool(pool_),
+      worker(&background_scavenger::run, this,
+             retained_bytes / pool_type::slab_bytes, period, batch) {}
+
+  background_scavenger(const background_scavenger&) = delete;
+  background_scavenger& operator=(const background_scavenger&) = delete;
+
+  ~background_scavenger() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    wake.notify_one();
+    worker.join();
+  }
+};
+
+#endif
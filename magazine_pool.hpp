@@ -0,0 +1,284 @@
+#ifndef MAGAZINE_POOL_HPP
+#define MAGAZINE_POOL_HPP
+
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include "pool.hpp"
+
+/// A thread-safe pool which caches objects per CPU instead of per thread,
+/// after Bonwick's magazines. It suits programs with many more threads
+/// than cores, where concurrent_compacting_pool would keep a cache (and
+/// the objects parked in it) for every thread.
+///
+/// A magazine is an array of up to rounds objects. Each CPU holds a loaded
+/// and a previous magazine: alloc pops from the loaded one and free pushes
+/// to it, and when it runs empty or full the two are swapped, so a thread
+/// going back and forth at the boundary doesn't hit the layers below.
+/// When both are empty (or both full) the CPU trades one with the depot,
+/// two lock-free stacks of full and empty magazines. Only when the depot
+/// has no full magazine to give does a CPU fill one from the slabs, a
+/// single base_compacting_pool under a mutex.
+///
+/// The CPU comes from sched_getcpu, and since a thread can migrate right
+/// after reading it each CPU's magazines sit behind a flag taken with a
+/// single exchange - rseq could drop that, at the cost of a restartable
+/// sequence in assembly per target. The flag is almost never contended,
+/// when it is (the holder was preempted) the thread tries the next CPU
+/// and then goes to the slabs, it never spins.
+///
+/// Magazines come from a fixed arena made with the pool, so the depot
+/// stacks link them by index and tag the head with a counter to avoid
+/// ABA. Once the arena is used up a full CPU frees a magazine's worth of
+/// objects back to the slabs instead. drain() hands the depot's objects
+/// back to the slabs and releases the free slabs.
+template <size_t size, size_t align, size_t rounds = 32>
+class magazine_pool {
+
+  struct magazine {
+    // the arena index + 1 of the next magazine on a depot stack
+    uint32_t next;
+    uint32_t count;
+    void* objects[rounds];
+  };
+
+  // only the thread holding busy touches the magazines
+  struct cpu_cache {
+    std::atomic<bool> busy;
+    magazine* loaded;
+    magazine* previous;
+    char pad[64 - sizeof(std::atomic<bool>) - 2 * sizeof(magazine*)];
+
+    cpu_cache() : busy(false), loaded(nullptr), previous(nullptr) {}
+  };
+
+  // the tag is the high half, the arena index + 1 of the top magazine
+  // (or 0) the low half
+  struct depot_stack {
+    std::atomic<uint64_t> head;
+    char pad[64 - sizeof(std::atomic<uint64_t>)];
+
+    depot_stack() : head(0) {}
+  };
+
+  typedef base_compacting_pool<size, align> slab_pool;
+
+  // CPUs tried before going to the slabs
+  constexpr static size_t cpu_tries = 2;
+
+  const size_t num_cpus;
+  cpu_cache* cpus;
+
+  const uint32_t arena_size;
+  magazine* arena;
+  std::atomic<uint32_t> arena_used;
+
+  depot_stack full_magazines;
+  depot_stack empty_magazines;
+
+  std::mutex slab_lock;
+  slab_pool slabs;
+
+  magazine* pop(depot_stack& stack) {
+    uint64_t head = stack.head.load(std::memory_order_acquire);
+    while (true) {
+      uint32_t index = (uint32_t)head;
+      if (!index) return nullptr;
+      magazine* m = &arena[index - 1];
+      // m may be popped and pushed elsewhere under us, the tag makes the
+      // cas fail then. Magazines are never freed, so the read is safe
+      uint32_t next = __atomic_load_n(&m->next, __ATOMIC_RELAXED);
+      uint64_t new_head = (((head >> 32) + 1) << 32) | next;
+      if (stack.head.compare_exchange_weak(head, new_head,
+                                           std::memory_order_acquire)) {
+        return m;
+      }
+    }
+  }
+
+  void push(depot_stack& stack, magazine* m) {
+    uint32_t index = (uint32_t)(m - arena) + 1;
+    uint64_t head = stack.head.load(std::memory_order_relaxed);
+    uint64_t new_head;
+    do {
+      __atomic_store_n(&m->next, (uint32_t)head, __ATOMIC_RELAXED);
+      new_head = (((head >> 32) + 1) << 32) | index;
+    } while (!stack.head.compare_exchange_weak(head, new_head,
+                                               std::memory_order_release));
+  }
+
+  magazine* new_magazine() {
+    if (arena_used.load(std::memory_order_relaxed) >= arena_size) {
+      return nullptr;
+    }
+    uint32_t index = arena_used.fetch_add(1, std::memory_order_relaxed);
+    if (index >= arena_size) return nullptr;
+    arena[index].count = 0;
+    return &arena[index];
+  }
+
+  cpu_cache* lock_cpu() {
+    int cpu = sched_getcpu();
+    size_t first = cpu < 0 ? 0 : (size_t)cpu;
+    for (size_t i = 0; i < cpu_tries && i < num_cpus; i++) {
+      cpu_cache* c = &cpus[(first + i) % num_cpus];
+      if (!c->busy.exchange(true, std::memory_order_acquire)) return c;
+    }
+    return nullptr;
+  }
+
+  static void unlock_cpu(cpu_cache* c) {
+    c->busy.store(false, std::memory_order_release);
+  }
+
+  __attribute__ ((noinline)) void reload(cpu_cache& c);
+  __attribute__ ((noinline)) void unload(cpu_cache& c);
+  __attribute__ ((noinline)) void* slab_alloc();
+  __attribute__ ((noinline)) void slab_free(void* obj);
+
+public:
+
+  /// depot_magazines bounds the magazines in the depot, on top of the
+  /// two every CPU holds. 0 sizes it at two per CPU as well
+  explicit magazine_pool(size_t depot_magazines = 0);
+
+  magazine_pool(const magazine_pool&) = delete;
+  magazine_pool& operator=(const magazine_pool&) = delete;
+
+  ~magazine_pool();
+
+  void* alloc() {
+    cpu_cache* c = lock_cpu();
+    if (likely(c)) {
+      if (unlikely(!c->loaded->count)) reload(*c);
+      magazine* m = c->loaded;
+      void* obj = m->count ? m->objects[--m->count] : nullptr;
+      unlock_cpu(c);
+      if (likely(obj)) return obj;
+    }
+    return slab_alloc();
+  }
+
+  void free(void* to_ret) {
+    cpu_cache* c = lock_cpu();
+    if (likely(c)) {
+      if (unlikely(c->loaded->count == rounds)) unload(*c);
+      magazine* m = c->loaded;
+      bool cached = m->count < rounds;
+      if (likely(cached)) m->objects[m->count++] = to_ret;
+      unlock_cpu(c);
+      if (likely(cached)) return;
+    }
+    slab_free(to_ret);
+  }
+
+  /// Frees the objects of every full magazine in the depot into the slabs
+  /// and releases the slabs left free, returning how many objects went
+  /// back. The CPUs keep their own magazines
+  size_t drain();
+
+  constexpr static size_t slab_bytes = slab_pool::slab_bytes;
+};
+
+template<size_t si, size_t a, size_t r>
+magazine_pool<si, a, r>::magazine_pool(size_t depot_magazines)
+  : num_cpus(std::max<long>(sysconf(_SC_NPROCESSORS_CONF), 1)),
+    cpus(new cpu_cache[num_cpus]),
+    arena_size(num_cpus * 2 + (depot_magazines ? depot_magazines
+                                               : num_cpus * 2)),
+    arena((magazine*)malloc(arena_size * sizeof(magazine))),
+    arena_used(0) {
+  if (!arena) throw std::bad_alloc();
+  for (size_t i = 0; i < num_cpus; i++) {
+    cpus[i].loaded = new_magazine();
+    cpus[i].previous = new_magazine();
+  }
+}
+
+template<size_t si, size_t a, size_t r>
+magazine_pool<si, a, r>::~magazine_pool() {
+  // the slabs go with the slab pool, whichever magazines the objects
+  // are sitting in
+  delete[] cpus;
+  ::free(arena);
+}
+
+template<size_t si, size_t a, size_t r>
+void magazine_pool<si, a, r>::reload(cpu_cache& c) {
+  if (c.previous->count) {
+    std::swap(c.loaded, c.previous);
+    return;
+  }
+  magazine* full = pop(full_magazines);
+  if (full) {
+    push(empty_magazines, c.previous);
+    c.previous = c.loaded;
+    c.loaded = full;
+    return;
+  }
+  std::lock_guard<std::mutex> guard(slab_lock);
+  c.loaded->count = slabs.alloc_bulk(c.loaded->objects, r);
+}
+
+template<size_t si, size_t a, size_t r>
+void magazine_pool<si, a, r>::unload(cpu_cache& c) {
+  if (c.previous->count < r) {
+    std::swap(c.loaded, c.previous);
+    return;
+  }
+  magazine* empty = pop(empty_magazines);
+  empty = empty ? empty : new_magazine();
+  if (empty) {
+    push(full_magazines, c.previous);
+    c.previous = c.loaded;
+    c.loaded = empty;
+    return;
+  }
+  // out of magazines, the previous one's objects go back to the slabs
+  {
+    std::lock_guard<std::mutex> guard(slab_lock);
+    std::sort(c.previous->objects, c.previous->objects + r);
+    slabs.free_bulk(c.previous->objects, r);
+  }
+  c.previous->count = 0;
+  std::swap(c.loaded, c.previous);
+}
+
+template<size_t si, size_t a, size_t r>
+void* magazine_pool<si, a, r>::slab_alloc() {
+  std::lock_guard<std::mutex> guard(slab_lock);
+  return slabs.alloc();
+}
+
+template<size_t si, size_t a, size_t r>
+void magazine_pool<si, a, r>::slab_free(void* obj) {
+  std::lock_guard<std::mutex> guard(slab_lock);
+  slabs.free(obj);
+}
+
+template<size_t si, size_t a, size_t r>
+size_t magazine_pool<si, a, r>::drain() {
+  size_t freed = 0;
+  while (magazine* m = pop(full_magazines)) {
+    {
+      std::lock_guard<std::mutex> guard(slab_lock);
+      std::sort(m->objects, m->objects + m->count);
+      slabs.free_bulk(m->objects, m->count);
+    }
+    freed += m->count;
+    m->count = 0;
+    push(empty_magazines, m);
+  }
+  std::lock_guard<std::mutex> guard(slab_lock);
+  slabs.clear_cache();
+  slabs.scavenge((size_t)0 - 1);
+  return freed;
+}
+
+#endif
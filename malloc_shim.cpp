@@ -0,0 +1,415 @@
+// malloc, free and friends on top of size_class_pool, built as
+// libcompacting_malloc.so so that unmodified programs can be run with
+//
+//     LD_PRELOAD=./libcompacting_malloc.so program
+//
+// Requests go to one of three tiers:
+//
+//  * up to 1024 bytes, the small size classes on 16 KiB slabs, which are
+//    carved out of 2 MiB spans
+//  * up to 256 KiB, the mid size classes on 4 MiB slabs
+//  * anything larger, or aligned past a page, is mapped directly
+//
+// Every class is aligned to the largest power of two dividing its size, up
+// to a page, so posix_memalign and friends take the first class whose size
+// is a multiple of the alignment.
+//
+// Slabs and spans come straight from mmap since malloc can't be used to
+// build malloc, but only a few mappings are made per span or mid slab - a
+// mapping per block would run into vm.max_map_count once frees leave holes.
+// Each tier tags the 2 MiB chunks it maps in chunk_kinds, so free finds the
+// tier of a pointer with one lookup: the slab (and its size class) of a
+// class object by masking, and the header of a large block right in front
+// of it.
+//
+// Each size class has its own spinlock. fork takes all of them first, so
+// the child never starts with a lock some other thread was holding. The
+// per-thread concurrent pool isn't used here, its thread caches are
+// allocated with new and its thread_local destructors register through
+// malloc.
+#include "size_class_pool.hpp"
+#include "span_source.hpp"
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <new>
+
+namespace {
+
+constexpr size_t page_bytes = 4096;
+
+// Which tier mapped each 2 MiB chunk of the address space. A two level
+// table of bytes, the leaves mapped as addresses in their range show up.
+// Linux only hands out addresses above 47 bits to mmap calls which ask
+// for them, so those are never tagged
+constexpr size_t chunk_shift = 21;
+constexpr size_t address_bits = 47;
+constexpr size_t leaf_bits = 14;
+constexpr size_t num_leaves = (size_t)1 << (address_bits - chunk_shift
+                                            - leaf_bits);
+
+enum chunk_kind : uint8_t {
+    untagged = 0,
+    small_chunk,
+    mid_chunk,
+    large_chunk
+};
+
+std::atomic<uint8_t *> chunk_kinds[num_leaves];
+
+uint8_t *leaf_for(size_t chunk) {
+    std::atomic<uint8_t *> &slot = chunk_kinds[chunk >> leaf_bits];
+    uint8_t *leaf = slot.load(std::memory_order_acquire);
+    if (leaf) {
+        return leaf;
+    }
+    void *fresh = mmap(nullptr, (size_t)1 << leaf_bits, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (fresh == MAP_FAILED) {
+        return nullptr;
+    }
+    if (!slot.compare_exchange_strong(leaf, (uint8_t *)fresh,
+                                      std::memory_order_acq_rel)) {
+        munmap(fresh, (size_t)1 << leaf_bits);
+        return leaf;
+    }
+    return (uint8_t *)fresh;
+}
+
+// Every chunk a new slab or block covers is tagged before it is handed
+// out, which also overwrites whatever tier the chunk belonged to before
+bool tag_chunks(void *p, size_t bytes, chunk_kind kind) {
+    size_t first = (size_t)p >> chunk_shift;
+    size_t last = ((size_t)p + bytes - 1) >> chunk_shift;
+    if (last >> (address_bits - chunk_shift)) {
+        return false;
+    }
+    for (size_t chunk = first; chunk <= last; chunk++) {
+        uint8_t *leaf = leaf_for(chunk);
+        if (!leaf) {
+            return false;
+        }
+        __atomic_store_n(&leaf[chunk & (((size_t)1 << leaf_bits) - 1)], kind,
+                         __ATOMIC_RELAXED);
+    }
+    return true;
+}
+
+chunk_kind kind_of(void *p) {
+    size_t chunk = (size_t)p >> chunk_shift;
+    if (chunk >> (address_bits - chunk_shift)) {
+        return untagged;
+    }
+    uint8_t *leaf = chunk_kinds[chunk >> leaf_bits].load(std::memory_order_acquire);
+    return leaf ? (chunk_kind)__atomic_load_n(
+                      &leaf[chunk & (((size_t)1 << leaf_bits) - 1)],
+                      __ATOMIC_RELAXED)
+                : untagged;
+}
+
+// A slab source which tags the chunks of every slab it hands out
+template <class slab_source, chunk_kind kind>
+struct tagging_source : slab_source {
+    tagging_source(slab_source src = slab_source()) : slab_source(src) {}
+
+    void *acquire_slab(size_t bytes) {
+        void *s = slab_source::acquire_slab(bytes);
+        if (s && !tag_chunks(s, bytes, kind)) {
+            slab_source::release_slab(s, bytes);
+            return nullptr;
+        }
+        return s;
+    }
+};
+
+typedef size_class_pool<tagging_source<span_slab_source, small_chunk>>
+    small_pool_type;
+
+// 1280 bytes to 256 KiB, four classes per doubling. The slabs are big
+// enough for a handful of the largest class, and each is its own mapping
+typedef size_class_set<(size_t)4 << 20,
+                       1280, 1536, 1792, 2048, 2560, 3072, 3584, 4096,
+                       5120, 6144, 7168, 8192, 10240, 12288, 14336, 16384,
+                       20480, 24576, 28672, 32768, 40960, 49152, 57344, 65536,
+                       81920, 98304, 114688, 131072, 163840, 196608, 229376,
+                       262144> mid_size_classes;
+
+typedef size_class_pool<tagging_source<mmap_slab_source, mid_chunk>,
+                        mid_size_classes> mid_pool_type;
+
+constexpr size_t class_align = small_pool_type::class_align;
+constexpr size_t num_small = small_pool_type::num_classes;
+constexpr size_t num_locks = num_small + mid_pool_type::num_classes;
+
+static_assert(mid_pool_type::max_class_align >= page_bytes,
+              "page aligned blocks are served by the mid classes");
+
+// sits right in front of the pointer handed out
+struct large_header {
+    void *mapped;
+    size_t mapped_bytes;
+};
+
+static_assert(sizeof(large_header) <= class_align,
+              "the large header must fit the smallest alignment gap");
+
+// malloc can be called before any static constructor has run,
+// so the pools are built in place on first use and never destroyed
+alignas(small_pool_type) char small_storage[sizeof(small_pool_type)];
+alignas(mid_pool_type) char mid_storage[sizeof(mid_pool_type)];
+small_pool_type *small_pool;
+mid_pool_type *mid_pool;
+std::atomic<int> init_state(0);
+// the small classes first, then the mid ones
+std::atomic_flag class_locks[num_locks] = {};
+
+void lock_all_classes() {
+    for (auto &flag : class_locks) {
+        while (flag.test_and_set(std::memory_order_acquire)) {}
+    }
+}
+
+void unlock_all_classes() {
+    for (auto &flag : class_locks) {
+        flag.clear(std::memory_order_release);
+    }
+}
+
+__attribute__ ((noinline)) void init_pools() {
+    int expected = 0;
+    if (init_state.compare_exchange_strong(expected, 1)) {
+        // transparent huge pages would fault in 2 MiB per size class
+        small_pool = new (small_storage) small_pool_type(
+            span_slab_source(huge_pages::none));
+        mid_pool = new (mid_storage) mid_pool_type();
+        init_state.store(2, std::memory_order_release);
+        // only once the pools are up, registering may call malloc
+        pthread_atfork(lock_all_classes, unlock_all_classes,
+                       unlock_all_classes);
+    }
+    while (init_state.load(std::memory_order_acquire) != 2) {}
+}
+
+inline void ensure_pools() {
+    if (unlikely(init_state.load(std::memory_order_acquire) != 2)) {
+        init_pools();
+    }
+}
+
+struct class_lock {
+    std::atomic_flag &flag;
+    explicit class_lock(size_t lock) : flag(class_locks[lock]) {
+        while (flag.test_and_set(std::memory_order_acquire)) {}
+    }
+    ~class_lock() { flag.clear(std::memory_order_release); }
+};
+
+template <class pool_type>
+void *alloc_class(pool_type *p, size_t first_lock, size_t cls) {
+    void *rval;
+    {
+        class_lock lock(first_lock + cls);
+        rval = p->alloc_class(cls);
+    }
+    if (!rval) {
+        errno = ENOMEM;
+    }
+    return rval;
+}
+
+template <class pool_type>
+void free_class(pool_type *p, size_t first_lock, void *ptr) {
+    size_t cls = p->class_of_object(ptr);
+    class_lock lock(first_lock + cls);
+    p->free_class(cls, ptr);
+}
+
+inline large_header *header_of(void *ptr) {
+    return (large_header *)ptr - 1;
+}
+
+// Alignments past class_align are met by mapping align more bytes than
+// needed, since the block can start up to align past the header, and
+// trimming off the pages in front of the header and past the block
+void *alloc_large(size_t bytes, size_t align) {
+    align = align < class_align ? class_align : align;
+    size_t slack = align > class_align ? align : 0;
+    size_t len;
+    if (bytes > ((size_t)0 - 1) / 2 || align > ((size_t)0 - 1) / 4
+        || __builtin_add_overflow(bytes, class_align + slack, &len)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    len = pool_geometry::round_up(len, page_bytes);
+    char *p = (char *)mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    char *rval = (char *)pool_geometry::round_up((size_t)p + sizeof(large_header),
+                                                 align);
+    char *start = (char *)((size_t)header_of(rval) & ~(page_bytes - 1));
+    char *end = (char *)pool_geometry::round_up((size_t)rval + bytes, page_bytes);
+    if (start != p) {
+        munmap(p, start - p);
+    }
+    if (end != p + len) {
+        munmap(end, p + len - end);
+    }
+    if (!tag_chunks(rval, 1, large_chunk)) {
+        munmap(start, end - start);
+        errno = ENOMEM;
+        return nullptr;
+    }
+    large_header *h = header_of(rval);
+    h->mapped = start;
+    h->mapped_bytes = end - start;
+    return rval;
+}
+
+void *alloc_aligned(size_t bytes, size_t align) {
+    if (align <= class_align) {
+        ensure_pools();
+        if (bytes <= small_pool_type::max_size) {
+            return alloc_class(small_pool, 0, small_pool->class_of(bytes));
+        }
+        if (bytes <= mid_pool_type::max_size) {
+            return alloc_class(mid_pool, num_small, mid_pool->class_of(bytes));
+        }
+    } else if (align <= page_bytes) {
+        ensure_pools();
+        size_t cls = small_pool->class_of(bytes, align);
+        if (cls < num_small) {
+            return alloc_class(small_pool, 0, cls);
+        }
+        cls = mid_pool->class_of(bytes, align);
+        if (cls < mid_pool_type::num_classes) {
+            return alloc_class(mid_pool, num_small, cls);
+        }
+    }
+    return alloc_large(bytes, align);
+}
+
+size_t usable_size(void *ptr) {
+    switch (kind_of(ptr)) {
+    case small_chunk:
+        return small_pool_type::usable_size(ptr);
+    case mid_chunk:
+        return mid_pool_type::usable_size(ptr);
+    case large_chunk: {
+        large_header *h = header_of(ptr);
+        return (char *)h->mapped + h->mapped_bytes - (char *)ptr;
+    }
+    default:
+        return 0;
+    }
+}
+
+inline bool is_pow2(size_t v) { return v && !(v & (v - 1)); }
+
+} // namespace
+
+extern "C" {
+
+void *malloc(size_t bytes) {
+    return alloc_aligned(bytes, class_align);
+}
+
+void free(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+    switch (kind_of(ptr)) {
+    case small_chunk:
+        free_class(small_pool, 0, ptr);
+        break;
+    case mid_chunk:
+        free_class(mid_pool, num_small, ptr);
+        break;
+    case large_chunk: {
+        large_header *h = header_of(ptr);
+        munmap(h->mapped, h->mapped_bytes);
+        break;
+    }
+    default:
+        // not from this allocator, there's nothing sane to do with it
+        break;
+    }
+}
+
+void *calloc(size_t num, size_t size) {
+    size_t bytes;
+    if (__builtin_mul_overflow(num, size, &bytes)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    void *rval = malloc(bytes);
+    if (rval) {
+        memset(rval, 0, bytes);
+    }
+    return rval;
+}
+
+void *realloc(void *ptr, size_t bytes) {
+    if (!ptr) {
+        return malloc(bytes);
+    }
+    if (!bytes) {
+        free(ptr);
+        return nullptr;
+    }
+    size_t have = usable_size(ptr);
+    // stay put unless the block is too small, or a smaller class would fit
+    if (bytes <= have && (have > mid_pool_type::max_size || bytes > have / 2)) {
+        return ptr;
+    }
+    void *rval = malloc(bytes);
+    if (rval) {
+        memcpy(rval, ptr, bytes < have ? bytes : have);
+        free(ptr);
+    }
+    return rval;
+}
+
+size_t malloc_usable_size(void *ptr) {
+    return ptr ? usable_size(ptr) : 0;
+}
+
+int posix_memalign(void **out, size_t align, size_t bytes) {
+    if (!is_pow2(align) || align % sizeof(void *)) {
+        return EINVAL;
+    }
+    int saved = errno;
+    void *rval = alloc_aligned(bytes, align);
+    errno = saved;
+    if (!rval) {
+        return ENOMEM;
+    }
+    *out = rval;
+    return 0;
+}
+
+void *aligned_alloc(size_t align, size_t bytes) {
+    if (!is_pow2(align)) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    return alloc_aligned(bytes, align);
+}
+
+void *memalign(size_t align, size_t bytes) {
+    return aligned_alloc(align, bytes);
+}
+
+void *valloc(size_t bytes) {
+    return alloc_aligned(bytes, page_bytes);
+}
+
+void *pvalloc(size_t bytes) {
+    return alloc_aligned(pool_geometry::round_up(bytes, page_bytes), page_bytes);
+}
+
+} // extern "C"
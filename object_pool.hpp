@@ -0,0 +1,107 @@
+#ifndef OBJECT_POOL_HPP
+#define OBJECT_POOL_HPP
+
+#include <stddef.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "pool.hpp"
+
+/// The global pool for objects of type T, one per T and Tag
+/// Parameters:
+///     T: The type constructed in the pool
+///     Tag: Any type, gives T a pool of its own apart from the
+///          pools of other tags with the same T
+///
+/// Types of the same size still get separate pools, so objects of one
+/// type sit next to each other instead of being interleaved with
+/// whatever else has that size.
+///
+/// The pool is built on first use and never destroyed, so objects may be
+/// freed from static destructors which run after it would have been.
+/// Like base_compacting_pool it isn't thread safe
+template <class T, class Tag = default_pool_tag>
+class object_pool {
+public:
+
+  typedef base_compacting_pool<sizeof(T), alignof(T)> pool_type;
+
+  static pool_type& pool() {
+    static pool_type* p = new pool_type();
+    return *p;
+  }
+
+  /// Constructs a T in the pool, returning nullptr when the pool is out
+  /// of memory. If the constructor throws the memory goes back first
+  template <class... Args>
+  static T* make(Args&&... args) {
+    void* mem = pool().alloc();
+    if (!mem) {
+      return nullptr;
+    }
+    try {
+      return new (mem) T(std::forward<Args>(args)...);
+    } catch (...) {
+      pool().free(mem);
+      throw;
+    }
+  }
+
+  /// Destructs obj and returns it to the pool, obj may be nullptr
+  static void destroy(T* obj) {
+    if (obj) {
+      obj->~T();
+      pool().free(obj);
+    }
+  }
+};
+
+/// An STL allocator which takes single objects from object_pool<T, Tag>.
+/// Node based containers rebind it to their node type, so every
+/// std::list, std::map or std::unordered_map using the same value type
+/// and Tag shares one pool of nodes. Requests for more than one object,
+/// like the bucket array of an unordered_map, go to operator new
+template <class T, class Tag = default_pool_tag>
+struct pool_allocator {
+  typedef T value_type;
+  typedef std::true_type is_always_equal;
+
+  template <class U>
+  struct rebind {
+    typedef pool_allocator<U, Tag> other;
+  };
+
+  pool_allocator() noexcept {}
+
+  template <class U>
+  pool_allocator(const pool_allocator<U, Tag>&) noexcept {}
+
+  T* allocate(size_t n) {
+    void* mem = n == 1 ? object_pool<T, Tag>::pool().alloc()
+                       : ::operator new(n * sizeof(T));
+    if (!mem) {
+      throw std::bad_alloc();
+    }
+    return (T*)mem;
+  }
+
+  void deallocate(T* p, size_t n) noexcept {
+    if (n == 1) {
+      object_pool<T, Tag>::pool().free(p);
+    } else {
+      ::operator delete(p);
+    }
+  }
+};
+
+template <class T, class U, class Tag>
+bool operator==(const pool_allocator<T, Tag>&, const pool_allocator<U, Tag>&) {
+  return true;
+}
+
+template <class T, class U, class Tag>
+bool operator!=(const pool_allocator<T, Tag>&, const pool_allocator<U, Tag>&) {
+  return false;
+}
+
+#endif
@@ -4,14 +4,19 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include "util.hpp"
-
-#define assert(x)
+#include <algorithm>
+#include <chrono>
+#include <type_traits>
+#include "slab.hpp"
+#include "pool_stats.hpp"
 
 /// This is the base class for allocating objects of a certain size
 /// Parameters:
 ///     size: The size of each block being allocated
 ///     align: The minimum alignment of each object
+///     slab_source: Where slab memory comes from, see malloc_slab_source
+///     stats_policy: no_pool_stats, or counting_pool_stats to count
+///                   allocations, evictions and refills for get_stats
 ///
 /// The pools works at two levels:
 ///
@@ -20,12 +25,14 @@
 ///    used objects as the most-recently allocated. When the stack is full,
 ///    a free causes the object at the bottom to be evicted.
 ///
-/// 2. Backing the fresh cache is a set of aligned slabs - each one contains
-///    (16, 32, 64), however many bits are in a size_t objects (more pending).
+/// 2. Backing the fresh cache is a set of aligned slabs. Each slab is a
+///    power-of-two sized span aligned to its own size, holding as many
+///    objects as fit next to the header - small objects get a multi-word
+///    bitmask, large objects get a bigger span (see slab.hpp).
 ///    This detail allows extremely easy lookup of the first available object
 ///    in sequential order without pointer lookups and also makes it possible
 ///    to store objects without allocating extra space per-object or modifying
-///    the object after free. Allocating from a slab requires looking up the
+///    the object after free. Finding the slab of an object is a single AND.
 ///
 /// Why all this instead of a basic pool? It allows storing objects without
 /// modifying them or adding extra fields, and it also means that the locality
@@ -36,13 +43,15 @@
 /// A secondary advantage is that bulk-loading from a slab into the cache is
 /// each loop iteration ony depends on the value of the bitmask and not on
 /// loads from a possibly uncached linked list of usable objects.
-template <size_t size, size_t align>
-class base_compacting_pool {
+template <size_t size, size_t align, class slab_source = malloc_slab_source,
+          class stats_policy = no_pool_stats>
+class base_compacting_pool : stats_policy {
 
+  // the mask sets the active window of held_buffer, see set_cache_depth
   struct small_index {
-    small_index(uint32_t v) : val(v) {}
+    small_index(uint32_t v, uint32_t m) : val(v), mask(m) {}
     uint32_t val;
-    constexpr static size_t mask = 63;
+    uint32_t mask;
     void inc() {
       val = (val + 1) & mask;
     }
@@ -57,84 +66,263 @@ class base_compacting_pool {
     alignas(align) char data[size];
   };
 
-  constexpr static size_t bits_per_size = sizeof(size_t) * 8;
-  constexpr static size_t all_ones = (0 - 1);
+  constexpr static size_t bits_per_size = pool_geometry::bits_per_word;
+
+public:
+
+  /// Bounds of the ring buffer cache, which starts out default_cache_depth
+  /// deep and can be changed with set_cache_depth or set_adaptive
+  constexpr static size_t max_cache_depth = 256;
+  constexpr static size_t min_cache_depth = 8;
+  constexpr static size_t default_cache_depth = 64;
+
+  constexpr static bool shared = slab_source::shared_slabs;
+  constexpr static size_t slab_bytes =
+    pool_geometry::slab_bytes(sizeof(dummy_object), alignof(dummy_object),
+                              shared, slab_source::min_slab_bytes);
+  constexpr static size_t objects_per_slab =
+    pool_geometry::objects_in(slab_bytes, sizeof(dummy_object),
+                              alignof(dummy_object), shared);
+  constexpr static size_t mask_words =
+    pool_geometry::mask_words(slab_bytes, sizeof(dummy_object),
+                              alignof(dummy_object), shared);
 
-  struct slab {
-    dummy_object members[bits_per_size];
-    size_t open_bitmask;
-    slab* next, *prev;
+private:
+
+  struct slab : slab_header,
+                std::conditional<shared,
+                                 pool_geometry::remote_header<mask_words>,
+                                 pool_geometry::no_remote_header>::type {
+    size_t open_bitmask[mask_words];
+    dummy_object members[objects_per_slab];
+
+    void init() {
+      slab_bits::init(open_bitmask, mask_words, objects_per_slab);
+      num_open = objects_per_slab;
+      object_size = sizeof(dummy_object);
+      this->init_remote();
+#if defined(COMPACTING_POOL_HARDENED)
+      magic = pool_debug::magic_of(this);
+      pool_debug::fill(members, sizeof(members));
+#endif
+      pool_debug::asan_poison(members, sizeof(members));
+    }
+
+    size_t first_open_word() const {
+      return slab_bits::first_open_word(open_bitmask, mask_words);
+    }
 
     dummy_object* get_object() {
-      dummy_object* obj = &members[get_and_clear_first_set(&open_bitmask)];
-      return obj;
+      --num_open;
+      return &members[slab_bits::take_first(open_bitmask, mask_words)];
+    }
+
+    dummy_object* get_object_near(void* hint) {
+      --num_open;
+      size_t index = (dummy_object*)hint - &members[0];
+      return &members[slab_bits::take_near(open_bitmask, mask_words, index)];
     }
 
-    dummy_object* return_object(void* _obj) {
-      dummy_object* obj = (dummy_object*)_obj;
-      open_bitmask = set_bit(open_bitmask, obj - &members[0]);
+    void return_object(void* _obj) {
+      size_t index = (dummy_object*)_obj - &members[0];
+      if (pool_debug::hardened && slab_bits::is_set(open_bitmask, index)) {
+        pool_fault("double free", _obj);
+      }
+      slab_bits::put(open_bitmask, index);
+      ++num_open;
     }
 
-    static slab* lookup_slab(void* obj) { return (slab*)((size_t)obj & ~4095); }
+    static slab* lookup_slab(void* obj) {
+      slab* s = (slab*)((size_t)obj & ~(slab_bytes - 1));
+#if defined(COMPACTING_POOL_HARDENED)
+      if (s->magic != pool_debug::magic_of(s)) {
+        pool_fault("free of a pointer which isn't from a pool slab", obj);
+      }
+#endif
+      return s;
+    }
   };
 
+  static_assert((slab_bytes & (slab_bytes - 1)) == 0,
+                "slabs must be a power of two to be found by masking");
+  static_assert(sizeof(slab) <= slab_bytes, "slab overruns its span");
+  static_assert(objects_per_slab >= pool_geometry::min_slab_objects,
+                "slab holds too few objects");
+
   constexpr static size_t partial_slabs = 0;
   constexpr static size_t full_slabs = 1;
-  constexpr static size_t retrieval_limit = 10;
+  constexpr static size_t empty_index = 2;
+  // fully free slabs are all kept for reuse by default, they only go
+  // back to the source from clean, scavenge or a retained limit
+  constexpr static size_t no_retained_limit = (size_t)0 - 1;
+
+  // adaptive sizing looks at this many refills and evictions at a time
+  constexpr static uint32_t adapt_period = 256;
+
+  // a refill prefetches the objects handed out first, a few at a time
+  // so the prefetches don't queue up behind each other
+  constexpr static size_t refill_prefetch = 4;
 
   void* current;
-  uint32_t alloc_streak = 0;
-  uint32_t evict_streak = 0;
-  uint32_t load_streak = 0;
-  small_index stack_head = 0;
+  small_index stack_head;
+  size_t retained_limit = no_retained_limit;
+  uint32_t window_refills = 0;
+  uint32_t window_evictions = 0;
+  bool adaptive = false;
 
-  void* held_buffer[256];
-  slab* empty_slabs;
-  slab* data_slabs[2];
+  void* held_buffer[max_cache_depth];
+  slab_header* empty_slabs;
+  slab_header* data_slabs[2];
+  slab_source source;
 
-  void* add_slab() {
-    slab* s;
-    if (posix_memalign((void**)&s, 4096, sizeof(*s))) {
-      return nullptr;
-    }
-    s->next = empty_slabs;
-    if (empty_slabs)
-      empty_slabs->prev = s;
-    empty_slabs = s;
-    s->prev = nullptr;
-    s->open_bitmask = (0 - 1) ^ 1;
-    // only called when empty!
-    load_all(s);
-    return s->members;
-  }
+  // slabs other pools have freed into, only used with shared slabs
+  slab_header* remote_slabs;
 
-  void* get_from_slab_list();
+  // set with set_relocator, compact does nothing without it
+  void (*relocate)(void* from, void* to, void* context) = nullptr;
+  void* relocate_context = nullptr;
 
+  // slab counts of data_slabs and then empty_slabs. Only the owning
+  // thread changes them, but get_stats may read them from any thread
+  relaxed_counter list_sizes[3];
 
+  // slabs lent out to regions, which keep them off the lists above
+  relaxed_counter region_slabs;
 
-  void load_all(slab* s);
+  // the slab the last paused heap walk resumes at, in walk_list. A slab
+  // leaving the list moves the mark on to the one after it, so the walk
+  // never has to find its place again. walk_ticket tells that walk from
+  // any other paused on the pool
+  slab_header* walk_mark = nullptr;
+  slab_header** walk_list = nullptr;
+  uint64_t walk_ticket = 0;
+
+  // where the next compaction pick starts looking in the partial list,
+  // moved on like walk_mark. A pass runs from the call which clears the
+  // cache until a whole lap of the list goes by without a move
+  constexpr static size_t compact_window = 16;
+  slab_header* compact_mark = nullptr;
+  size_t compact_idle = 0;
+  bool compact_pass = false;
+
+  relaxed_counter& size_of(slab_header*& list) {
+    return list_sizes[&list == &empty_slabs ? empty_index
+                                            : &list - data_slabs];
+  }
 
-  static void remove_slab(slab* s, slab*& head) {
-    if (s->prev == s) {
-      head = nullptr;
-      s->prev = s->next = nullptr;
-      return;
+  size_t num_full() const { return list_sizes[full_slabs].get(); }
+
+  void link_front(slab* s, slab_header*& list) {
+    slab_list::push_front(s, list);
+    size_of(list).add(1);
+  }
+
+  void link_back(slab* s, slab_header*& list) {
+    slab_list::push_back(s, list);
+    size_of(list).add(1);
+  }
+
+  void unlink_slab(slab* s, slab_header*& list) {
+    if (unlikely(s == walk_mark)) {
+      walk_mark = s->next == list ? nullptr : s->next;
+    }
+    if (unlikely(s == compact_mark)) {
+      compact_mark = s->next == list ? nullptr : s->next;
     }
-    if (s->prev) {
-      s->prev->next = s->next;
+    size_of(list).sub(1);
+    slab_list::remove(s, list);
+  }
+
+  void release_slab(slab_header* s) {
+#if defined(COMPACTING_POOL_HARDENED)
+    s->magic = 0;
+#endif
+    pool_debug::asan_unpoison(s, slab_bytes);
+    source.release_slab(s, slab_bytes);
+    this->count_slab_released();
+  }
+
+  slab* new_slab() {
+    slab* s = (slab*)source.acquire_slab(slab_bytes);
+    if (!s) {
+      return nullptr;
     }
-    if (s->next) {
-      s->next->prev = s->prev;
+    s->init();
+    s->owner = this;
+    link_front(s, data_slabs[partial_slabs]);
+    this->count_slab_created();
+    return s;
+  }
+
+  // hardened and ASan builds check every object handed out or taken
+  // back, in other builds these are empty (see pool_debug in slab.hpp)
+  void check_alloc(void* obj) {
+    pool_debug::asan_unpoison(obj, sizeof(dummy_object));
+    if (pool_debug::hardened
+        && !pool_debug::is_filled(obj, sizeof(dummy_object))) {
+      pool_fault("object written after it was freed", obj);
     }
+  }
+
+  void check_free(void* obj);
 
-    if (s == head) {
-      head = s->next;
+  slab* take_region_slab(void* owner);
+
+  bool in_cache(void* obj) const {
+    if (current == obj) return true;
+    for (void* cached : held_buffer) {
+      if (cached == obj) return true;
     }
+    return false;
+  }
+
+  void* add_slab() {
+    slab* s = new_slab();
+    return s ? refill_from(s, data_slabs[partial_slabs]) : nullptr;
   }
 
+  static size_t take_objects(slab* s, void** out, size_t n);
+
+  void* get_from_slab_list();
+
+  void* refill_from(slab* s, slab_header*& list);
+
+  void load_all(slab* s);
+
   void evict_item(void *val);
 
-  static void clean_slab_list(slab*& _s);
+  slab_header*& list_for(uint32_t num_open) {
+    return num_open == 0 ? empty_slabs
+         : num_open == objects_per_slab ? data_slabs[full_slabs]
+         : data_slabs[partial_slabs];
+  }
+
+  void place_slab(slab* s);
+
+  void adapt_depth();
+
+  void count_window(uint32_t& events) {
+    ++events;
+    if (unlikely(window_refills + window_evictions >= adapt_period)) {
+      adapt_depth();
+    }
+  }
+
+  typedef std::integral_constant<bool, shared> shared_tag;
+
+  static void remote_free(slab*, void*, std::false_type) {}
+  static void remote_free(slab* s, void* obj, std::true_type);
+
+  void collect_remote(std::false_type) {}
+  void collect_remote(std::true_type);
+
+  void clean_slab_list(slab_header*& _s);
+
+  bool pick_compaction(slab*& from, slab*& to);
+
+  bool evict_cached(slab* s);
+
+  size_t move_objects(slab* from, slab* to, size_t max_objects);
 
   template <bool do_malloc> void* base_try_alloc();
 
@@ -144,84 +332,771 @@ public:
 
   void* try_alloc() { return base_try_alloc<false>(); }
 
+  /// Allocates the open object closest to hint in hint's own slab, so
+  /// that a tree child or list successor shares its parent's cache line
+  /// or page. Falls back to alloc when that slab has nothing open.
+  /// hint must be an object from this pool, or nullptr
+  void* alloc_near(void* hint);
+
   void clear_cache();
 
 
   void free(void* to_ret);
 
+  /// Allocates up to n objects into out, first from the cache and then
+  /// straight from the slabs, returning how many were allocated
+  size_t alloc_bulk(void** out, size_t n);
+
+  /// Frees n objects straight into their slabs without going through
+  /// the cache. Runs of objects from the same slab are merged into
+  /// the bitmask together and move the slab between lists at most once
+  void free_bulk(void* const* in, size_t n);
 
-  void clean() { clean_slab_list(data_slabs[full_slabs]); }
+  void clean();
+
+  /// Hands up to max_slabs fully free slabs back to the source, oldest
+  /// first, keeping the newest keep_slabs, and returns how many were
+  /// released. This bounds the work of one call, so it can be spread
+  /// out instead of one long clean()
+  size_t scavenge(size_t max_slabs, size_t keep_slabs = 0);
+
+  /// Scavenges a few slabs at a time until there are no more past
+  /// keep_slabs or budget has run out. The pool isn't thread safe, so
+  /// this is the one to call from the owner's idle points where a
+  /// concurrent pool would use a background_scavenger
+  size_t scavenge_for(std::chrono::nanoseconds budget, size_t keep_slabs = 0);
+
+  /// Caps the fully free slabs the pool keeps around - once more than
+  /// this many are free, each newly freed slab releases the oldest one.
+  /// There is no cap by default, releasing slabs on the free path makes
+  /// a pool which swings around the cap refault its pages over and over
+  void set_retained_limit(size_t slabs) {
+    retained_limit = slabs;
+    if (num_full() > retained_limit) scavenge(num_full() - retained_limit);
+  }
+
+  size_t free_slabs() const { return num_full(); }
+
+  /// Moves the object at from to the fresh object at to, and points
+  /// every reference to it (or its handle) at the new address
+  typedef void (*relocate_fn)(void* from, void* to, void* context);
+
+  /// Opts the pool in to compact. The pool never touches object contents
+  /// itself, fn does the move and gets context back on every call
+  void set_relocator(relocate_fn fn, void* context = nullptr) {
+    relocate = fn;
+    relocate_context = context;
+  }
+
+  /// Empties the sparsest partially used slabs by relocating their objects
+  /// into the densest ones, and hands each emptied slab back to the source.
+  /// Moves at most budget objects and returns how many were moved, so it
+  /// can be called a little at a time - slabs are compared a window at a
+  /// time, so a call costs about the same however big the pool is. Objects
+  /// held in the cache look allocated to their slabs, so the first call of
+  /// a pass clears it and later calls only evict those in the slab about
+  /// to be emptied. A pass ends with the first call which returns 0.
+  /// Not available with shared slabs, another pool's cache can hold
+  /// objects from this pool's slabs
+  size_t compact(size_t budget);
+
+  /// Allocates objects which all die together, from slabs of its own.
+  /// Its objects are never freed one by one - release_all hands every
+  /// slab back to the pool at once, in time proportional to the slabs
+  /// rather than the objects, unless a sampling stats policy has to
+  /// check each object. The slabs come from the pool's fully free slabs
+  /// first, and go back to them (or to the source, past a retained limit)
+  /// on release. Region objects are counted and sampled like any others,
+  /// the release counting as their frees.
+  ///
+  /// Objects from a region must not be passed to free, and a region must
+  /// be released before its pool is reset or destroyed. Not available
+  /// with shared slabs
+  class region {
+    base_compacting_pool& pool;
+    // the slab being filled is at the front
+    slab_header* slabs = nullptr;
+
+  public:
+    explicit region(base_compacting_pool& pool_) : pool(pool_) {
+      static_assert(!shared, "regions need slabs owned by a single pool");
+    }
+
+    region(const region&) = delete;
+    region& operator=(const region&) = delete;
+
+    ~region() { release_all(); }
+
+    void* alloc();
+
+    void release_all();
+  };
+
+  size_t cache_depth() const { return stack_head.mask + 1; }
+
+  /// Prefetches, for writing, the next n objects alloc will return, as
+  /// far as they are in the cache. For a caller about to allocate a batch
+  /// of objects one by one, like building a tree
+  void prefetch(size_t n) const;
+
+  /// Resizes the ring buffer cache to depth, rounded up to a power of two
+  /// between min_cache_depth and max_cache_depth. Cached objects are kept,
+  /// except for the oldest ones when the cache shrinks below them
+  void set_cache_depth(size_t depth);
+
+  /// Lets the pool pick its own cache depth. Evicting objects and
+  /// refilling the cache within the same stretch of adapt_period events
+  /// doubles the depth - the working set keeps running off both ends of
+  /// the window. Only evicting halves it, as the pool is shrinking and
+  /// the cache would just pin slabs
+  void set_adaptive(bool on) { adaptive = on; }
+
+  /// Counters and slab list sizes, cheap enough to call from a metrics
+  /// thread while the owner keeps running. The counters are only kept
+  /// with counting_pool_stats
+  pool_stats get_stats() const;
+
+  /// Sorts the partially used slabs into buckets by the fraction of
+  /// their objects in use, the first bucket being the least used.
+  /// This walks the slab list, so only the owning thread may call it
+  template <size_t buckets>
+  void occupancy_histogram(size_t (&out)[buckets]) const;
+
+  /// The state of a heap walk, which can be spread over many calls
+  class heap_walk {
+    friend class base_compacting_pool;
+    // partial, full and then empty slabs
+    size_t list = 0;
+    size_t position = 0;
+    slab_header* next = nullptr;
+    uint64_t ticket = 0;
+    bool started = false;
+    // the cache when the walk started, sorted
+    void* cached[max_cache_depth + 1];
+    size_t num_cached = 0;
+
+  public:
+    heap_report report;
+  };
+
+  /// A visitor which does nothing, walk_heap then only reads headers
+  /// and bitmasks and never touches an object
+  struct no_visit {
+    void operator()(void*) const {}
+  };
 
-  base_compacting_pool();
-  ~base_compacting_pool();
+  /// Adds up to max_slabs more slabs to walk.report, calling visit on
+  /// every live object in them, and returns true once the walk has
+  /// covered the whole pool. Between calls the pool can be used as
+  /// usual, so a long walk never holds the owner up for more than
+  /// max_slabs slabs - but slabs which move between lists meanwhile
+  /// may be counted twice or not at all. The pool keeps the place of
+  /// the last walk paused on it up to date as slabs leave its list, so
+  /// resuming costs nothing. Walks interleaved on one pool have to find
+  /// their place again from the head of the list, which costs as many
+  /// steps as the walk is into it. Only the owning thread may walk the
+  /// pool
+  template <class visitor>
+  bool walk_heap(heap_walk& walk, size_t max_slabs, visitor visit);
+
+  bool walk_heap(heap_walk& walk, size_t max_slabs) {
+    return walk_heap(walk, max_slabs, no_visit());
+  }
+
+  /// Walks the whole pool in one go
+  heap_report walk_heap() {
+    heap_walk walk;
+    walk_heap(walk, (size_t)0 - 1);
+    return walk.report;
+  }
+
+  /// Returns every slab to the slab source, including ones with
+  /// outstanding objects - those objects are invalid afterwards
+  void reset();
+
+  slab_source& get_source() { return source; }
+
+  /// Merges objects which other pools freed into this pool's slabs.
+  /// Only needed with shared slab sources, refilling does this too
+  void collect_remote() { collect_remote(shared_tag()); }
+
+  base_compacting_pool(slab_source src = slab_source());
+  ~base_compacting_pool() { reset(); }
 
 };
 
 
-template<size_t s, size_t a>
-base_compacting_pool<s, a>::base_compacting_pool()
-  : current(nullptr), stack_head(0), empty_slabs(nullptr) {
+template<size_t s, size_t a, class src, class st>
+base_compacting_pool<s, a, src, st>::base_compacting_pool(src source_)
+  : current(nullptr), stack_head(0, default_cache_depth - 1),
+    empty_slabs(nullptr), source(source_),
+    remote_slabs(nullptr) {
   data_slabs[0] = nullptr;
   data_slabs[1] = nullptr;
   for (auto& ptr : held_buffer) ptr = nullptr;
 }
 
-template<size_t s, size_t a>
-base_compacting_pool<s, a>::~base_compacting_pool() {
+template<size_t s, size_t a, class src, class st>
+void base_compacting_pool<s, a, src, st>::reset() {
   clear_cache();
+  collect_remote();
   clean_slab_list(empty_slabs);
   clean_slab_list(data_slabs[partial_slabs]);
   clean_slab_list(data_slabs[full_slabs]);
+  compact_mark = nullptr;
+  compact_pass = false;
 }
 
+template<size_t si, size_t a, class src, class st>
+pool_stats base_compacting_pool<si, a, src, st>::get_stats() const {
+  pool_stats out;
+  this->read_counters(out);
+  out.empty_slabs = list_sizes[empty_index].get();
+  out.partial_slabs = list_sizes[partial_slabs].get();
+  out.full_slabs = list_sizes[full_slabs].get();
+  out.bytes_retained = (out.empty_slabs + out.partial_slabs + out.full_slabs
+                        + region_slabs.get())
+                       * slab_bytes;
+  out.bytes_free = out.full_slabs * slab_bytes;
+  return out;
+}
+
+template<size_t si, size_t a, class src, class st>
+template<size_t buckets>
+void base_compacting_pool<si, a, src, st>::occupancy_histogram(
+    size_t (&out)[buckets]) const {
+  for (auto& count : out) count = 0;
+  slab_header* s = data_slabs[partial_slabs];
+  if (!s) return;
+  do {
+    size_t in_use = objects_per_slab - s->num_open;
+    out[in_use * buckets / objects_per_slab] += 1;
+    s = s->next;
+  } while (s != data_slabs[partial_slabs]);
+}
+
+
+template<size_t si, size_t a, class src, class st>
+template<class visitor>
+bool base_compacting_pool<si, a, src, st>::walk_heap(heap_walk& walk,
+                                                     size_t max_slabs,
+                                                     visitor visit) {
+  heap_report& out = walk.report;
+  slab_header** lists[3] = {&data_slabs[partial_slabs],
+                            &data_slabs[full_slabs], &empty_slabs};
+  if (!walk.started) {
+    walk.started = true;
+    if (current) walk.cached[walk.num_cached++] = current;
+    for (void* cached : held_buffer) {
+      if (cached) walk.cached[walk.num_cached++] = cached;
+    }
+    std::sort(walk.cached, walk.cached + walk.num_cached);
+    walk.next = *lists[0];
+  } else if (walk.list < 3 && walk.ticket == walk_ticket) {
+    walk.next = walk_mark;
+  } else if (walk.list < 3) {
+    // another walk was paused since, so the saved slab may have moved
+    // or been released. Find the same position again from the head
+    slab_header* head = *lists[walk.list];
+    walk.next = head;
+    for (size_t i = 0; i < walk.position && walk.next; i++) {
+      walk.next = walk.next->next == head ? nullptr : walk.next->next;
+    }
+  }
+  size_t visited = 0;
+  while (walk.list < 3) {
+    slab_header* head = *lists[walk.list];
+    if (!walk.next) {
+      if (++walk.list < 3) walk.next = *lists[walk.list];
+      walk.position = 0;
+      continue;
+    }
+    if (visited == max_slabs) {
+      walk_mark = walk.next;
+      walk_list = lists[walk.list];
+      walk.ticket = ++walk_ticket;
+      return false;
+    }
+
+    slab* s = static_cast<slab*>(walk.next);
+    size_t used = objects_per_slab - s->num_open;
+    out.slabs += 1;
+    out.live_objects += used;
+    size_t bucket = used * heap_report::density_buckets / objects_per_slab;
+    out.density[bucket < heap_report::density_buckets
+                ? bucket : heap_report::density_buckets - 1] += 1;
+    if (!used) {
+      out.bytes_free_slabs += slab_bytes;
+    } else {
+      out.bytes_fragmented += s->num_open * sizeof(dummy_object);
+    }
+    out.bytes_overhead += slab_bytes - objects_per_slab * sizeof(dummy_object);
+    if (!std::is_same<visitor, no_visit>::value) {
+      for (size_t w = 0; w < mask_words; w++) {
+        size_t live = ~s->open_bitmask[w]
+                      & slab_bits::valid_bits(w, objects_per_slab);
+        while (live) {
+          void* obj = &s->members[w * bits_per_size
+                                  + get_and_clear_first_set(&live)];
+          if (!std::binary_search(walk.cached, walk.cached + walk.num_cached,
+                                  obj)) {
+            visit(obj);
+          }
+        }
+      }
+    }
+
+    ++visited;
+    ++walk.position;
+    walk.next = walk.next->next == head ? nullptr : walk.next->next;
+  }
+  if (walk.list == 3) {
+    walk.list = 4;
+    out.cached_objects = walk.num_cached;
+    out.live_objects -= std::min(out.live_objects, walk.num_cached);
+    out.bytes_live = out.live_objects * sizeof(dummy_object);
+    out.bytes_cached = walk.num_cached * sizeof(dummy_object);
+  }
+  return true;
+}
 
-template<size_t si, size_t a>
-void base_compacting_pool<si, a>::clean_slab_list(slab*& _s) {
-  slab* s = _s;
+template<size_t si, size_t a, class src, class st>
+void base_compacting_pool<si, a, src, st>::clean_slab_list(slab_header*& _s) {
+  if (walk_list == &_s) walk_mark = nullptr;
+  slab_header* s = _s;
   _s = nullptr;
+  size_of(_s).set(0);
+  if (!s) return;
+  s->prev->next = nullptr;
   while (s) {
-    slab* tofree = s;
-    remove_slab(s, s);
-    ::free(tofree);
+    slab_header* tofree = s;
+    s = s->next;
+    release_slab(tofree);
   }
 }
 
-template<size_t si, size_t a>
+template<size_t si, size_t a, class src, class st>
+void base_compacting_pool<si, a, src, st>::clean() {
+  slab* s = static_cast<slab*>(data_slabs[full_slabs]);
+  data_slabs[full_slabs] = nullptr;
+  list_sizes[full_slabs].set(0);
+  // the slabs kept are linked again in another order, so a paused walk
+  // skips the rest of the list
+  if (walk_list == &data_slabs[full_slabs]) walk_mark = nullptr;
+  if (!s) return;
+  s->prev->next = nullptr;
+  while (s) {
+    slab* next = static_cast<slab*>(s->next);
+    if (s->remote_idle()) {
+      release_slab(s);
+    } else {
+      link_front(s, data_slabs[full_slabs]);
+    }
+    s = next;
+  }
+}
+
+template<size_t si, size_t a, class src, class st>
+size_t base_compacting_pool<si, a, src, st>::scavenge(size_t max_slabs,
+                                                      size_t keep_slabs) {
+  size_t released = 0;
+  slab_header*& list = data_slabs[full_slabs];
+  // full slabs are pushed to the front, so the back has been free longest.
+  // Slabs still busy with remote frees are skipped, not released
+  size_t to_visit = num_full() > keep_slabs ? num_full() - keep_slabs : 0;
+  slab_header* s = list ? list->prev : nullptr;
+  while (released < max_slabs && to_visit--) {
+    slab_header* older = s->prev;
+    if (static_cast<slab*>(s)->remote_idle()) {
+      unlink_slab(static_cast<slab*>(s), list);
+      release_slab(static_cast<slab*>(s));
+      ++released;
+    }
+    s = older;
+  }
+  return released;
+}
+
+template<size_t si, size_t a, class src, class st>
+size_t base_compacting_pool<si, a, src, st>::scavenge_for(
+    std::chrono::nanoseconds budget, size_t keep_slabs) {
+  constexpr size_t batch = 8;
+  auto deadline = std::chrono::steady_clock::now() + budget;
+  size_t released = 0;
+  size_t got;
+  do {
+    got = scavenge(batch, keep_slabs);
+    released += got;
+  } while (got == batch && std::chrono::steady_clock::now() < deadline);
+  return released;
+}
+
+template<size_t si, size_t a, class src, class st>
+size_t base_compacting_pool<si, a, src, st>::compact(size_t budget) {
+  static_assert(!shared, "compact needs slabs owned by a single pool");
+  if (!relocate) return 0;
+  bool first = !compact_pass;
+  if (first) {
+    clear_cache();
+    compact_pass = true;
+    compact_idle = 0;
+  }
+  size_t moved = 0;
+  slab* from;
+  slab* to;
+  while (moved < budget) {
+    if (!pick_compaction(from, to)) {
+      compact_pass = false;
+      break;
+    }
+    // objects freed since the last call may sit in the cache, evicting
+    // them changes the slab lists so the pick is made again
+    if (!first && evict_cached(from)) continue;
+    moved += move_objects(from, to, budget - moved);
+    compact_idle = 0;
+    if (to->num_open == 0) {
+      unlink_slab(to, data_slabs[partial_slabs]);
+      link_front(to, empty_slabs);
+    }
+    if (from->num_open == objects_per_slab) {
+      unlink_slab(from, data_slabs[partial_slabs]);
+      release_slab(from);
+    }
+  }
+  this->count_relocations(moved);
+  return moved;
+}
+
+template<size_t si, size_t a, class src, class st>
+typename base_compacting_pool<si, a, src, st>::slab*
+base_compacting_pool<si, a, src, st>::take_region_slab(void* owner) {
+  // the most recently freed slab is the likeliest to still be cached
+  slab* s = static_cast<slab*>(data_slabs[full_slabs]);
+  if (s) {
+    unlink_slab(s, data_slabs[full_slabs]);
+  } else {
+    s = (slab*)source.acquire_slab(slab_bytes);
+    if (!s) return nullptr;
+    s->init();
+    this->count_slab_created();
+  }
+  s->owner = owner;
+  region_slabs.add(1);
+  return s;
+}
+
+template<size_t si, size_t a, class src, class st>
+void* base_compacting_pool<si, a, src, st>::region::alloc() {
+  slab* s = static_cast<slab*>(slabs);
+  if (unlikely(!s || !s->num_open)) {
+    s = pool.take_region_slab(this);
+    if (!s) return nullptr;
+    slab_list::push_front(s, slabs);
+  }
+  // the objects go out in order and all come back at once, so the
+  // bitmask is left alone and just reset on release
+  void* rval = &s->members[objects_per_slab - s->num_open--];
+  pool.count_alloc();
+  pool.check_alloc(rval);
+  pool.sample_alloc(rval, sizeof(dummy_object));
+  return rval;
+}
+
+template<size_t si, size_t a, class src, class st>
+void base_compacting_pool<si, a, src, st>::region::release_all() {
+  slab_header* s = slabs;
+  slabs = nullptr;
+  if (!s) return;
+  s->prev->next = nullptr;
+  while (s) {
+    slab* to_place = static_cast<slab*>(s);
+    s = s->next;
+    // the objects were handed out from the front of the slab, and go back
+    // in one go so allocs and frees still balance
+    size_t used = objects_per_slab - to_place->num_open;
+    pool.count_frees(used);
+    pool.sample_free_run(&to_place->members[0], used, sizeof(dummy_object));
+    to_place->init();
+    to_place->owner = &pool;
+    pool.region_slabs.sub(1);
+    pool.place_slab(to_place);
+  }
+}
+
+template<size_t si, size_t a, class src, class st>
+bool base_compacting_pool<si, a, src, st>::pick_compaction(slab*& from,
+                                                           slab*& to) {
+  slab_header* head = data_slabs[partial_slabs];
+  size_t partial = list_sizes[partial_slabs].get();
+  // the sparsest slab of a window is emptied into the densest, but only
+  // when the others in the window have room for all of its objects. A
+  // window which has nothing to move hands on to the next one
+  while (partial > 1 && compact_idle < partial) {
+    slab_header* first = compact_mark ? compact_mark : head;
+    slab_header* sparsest = first;
+    slab_header* densest = first;
+    size_t total_open = 0;
+    size_t seen = 0;
+    slab_header* s = first;
+    do {
+      total_open += s->num_open;
+      if (s->num_open > sparsest->num_open) sparsest = s;
+      if (s->num_open < densest->num_open) densest = s;
+      s = s->next;
+    } while (++seen < compact_window && seen < partial);
+    if (sparsest == densest) densest = sparsest->next;
+    size_t live = objects_per_slab - sparsest->num_open;
+    if (total_open - sparsest->num_open >= live) {
+      // the window is looked at again on the next pick
+      compact_mark = first;
+      from = static_cast<slab*>(sparsest);
+      to = static_cast<slab*>(densest);
+      return true;
+    }
+    compact_mark = s;
+    compact_idle += seen;
+  }
+  return false;
+}
+
+template<size_t si, size_t a, class src, class st>
+bool base_compacting_pool<si, a, src, st>::evict_cached(slab* s) {
+  bool found = current && slab::lookup_slab(current) == s;
+  for (size_t i = 0; i <= stack_head.mask && !found; i++) {
+    found = held_buffer[i] && slab::lookup_slab(held_buffer[i]) == s;
+  }
+  if (!found) return false;
+
+  // unwind the ring newest first and rebuild it without s's objects,
+  // the rest keep their order
+  void* kept[max_cache_depth + 1];
+  size_t num_kept = 0;
+  if (current) kept[num_kept++] = current;
+  small_index head = stack_head;
+  while (held_buffer[head.val]) {
+    kept[num_kept++] = held_buffer[head.val];
+    held_buffer[head.val] = nullptr;
+    head.dec();
+  }
+  size_t fits = 0;
+  for (size_t i = 0; i < num_kept; i++) {
+    if (slab::lookup_slab(kept[i]) == s) {
+      evict_item(kept[i]);
+    } else {
+      kept[fits++] = kept[i];
+    }
+  }
+  current = fits ? kept[0] : nullptr;
+  stack_head = small_index(0, stack_head.mask);
+  for (size_t i = fits; i > 1; i--) {
+    stack_head.inc();
+    held_buffer[stack_head.val] = kept[i - 1];
+  }
+  return true;
+}
+
+template<size_t si, size_t a, class src, class st>
+size_t base_compacting_pool<si, a, src, st>::move_objects(slab* from, slab* to,
+                                                          size_t max_objects) {
+  size_t moved = 0;
+  for (size_t w = 0; w < mask_words; w++) {
+    size_t live = ~from->open_bitmask[w]
+                  & slab_bits::valid_bits(w, objects_per_slab);
+    while (live) {
+      if (moved == max_objects || to->num_open == 0) return moved;
+      void* obj = &from->members[w * bits_per_size
+                                 + get_and_clear_first_set(&live)];
+      void* dest = to->get_object();
+      check_alloc(dest);
+      relocate(obj, dest, relocate_context);
+      this->sample_move(obj, dest);
+      check_free(obj);
+      from->return_object(obj);
+      ++moved;
+    }
+  }
+  return moved;
+}
+
+template<size_t si, size_t a, class src, class st>
+void base_compacting_pool<si, a, src, st>::check_free(void* obj) {
+  if (pool_debug::hardened) {
+    slab* s = slab::lookup_slab(obj);
+    size_t offset = (char*)obj - (char*)&s->members[0];
+    size_t index = offset / sizeof(dummy_object);
+    if (offset % sizeof(dummy_object) || index >= objects_per_slab) {
+      pool_fault("free of a pointer which isn't an object", obj);
+    }
+    // an object which looks freed is only a double free if it is cached,
+    // live objects may well hold the poison bytes
+    if (!shared && s->owner != this) {
+      pool_fault("free of an object from a region or another pool", obj);
+    }
+    bool owned = !shared || s->owner == this;
+    if ((owned && slab_bits::is_set(s->open_bitmask, index))
+        || (pool_debug::is_filled(obj, sizeof(dummy_object))
+            && in_cache(obj))) {
+      pool_fault("double free", obj);
+    }
+    pool_debug::fill(obj, sizeof(dummy_object));
+  }
+  pool_debug::asan_poison(obj, sizeof(dummy_object));
+}
+
+template<size_t si, size_t a, class src, class st>
 template<bool do_malloc>
-void *base_compacting_pool<si, a>::base_try_alloc() {
+void *base_compacting_pool<si, a, src, st>::base_try_alloc() {
   void* rval = current;
-  ++alloc_streak;
+  this->count_alloc();
   if (likely(rval)) {
+    this->count_cache_hit();
     current = held_buffer[stack_head.val];
     held_buffer[stack_head.val] = nullptr;
     stack_head.dec();
+    // the next alloc's object, pulled in while the caller uses this one
+    __builtin_prefetch(current, 1);
+    check_alloc(rval);
+    this->sample_alloc(rval, sizeof(dummy_object));
     return rval;
   }
   {
     void* slabval = get_from_slab_list();
-    return !slabval && do_malloc ? add_slab() : slabval;
+    slabval = !slabval && do_malloc ? add_slab() : slabval;
+    if (slabval) {
+      check_alloc(slabval);
+      this->sample_alloc(slabval, sizeof(dummy_object));
+    }
+    return slabval;
+  }
+}
+
+template<size_t si, size_t a, class src, class st>
+void *base_compacting_pool<si, a, src, st>::alloc_near(void* hint) {
+  if (!hint) {
+    return alloc();
+  }
+  slab* s = slab::lookup_slab(hint);
+  if ((shared && s->owner != this) || !s->num_open) {
+    return alloc();
   }
+  this->count_alloc();
+  slab_header*& old_list = list_for(s->num_open);
+  void* rval = s->get_object_near(hint);
+  slab_header*& new_list = list_for(s->num_open);
+  if (&old_list != &new_list) {
+    unlink_slab(s, old_list);
+    link_front(s, new_list);
+  }
+  check_alloc(rval);
+  this->sample_alloc(rval, sizeof(dummy_object));
+  return rval;
 }
 
-template<size_t si, size_t a>
-void base_compacting_pool<si, a>::free(void *to_ret) {
+template<size_t si, size_t a, class src, class st>
+void base_compacting_pool<si, a, src, st>::free(void *to_ret) {
+  check_free(to_ret);
+  this->sample_free(to_ret);
   void* to_write = current;
   current = to_ret;
+  this->count_free();
   if (likely(to_write)) {
     stack_head.inc();
     void* old_val = held_buffer[stack_head.val];
     held_buffer[stack_head.val] = to_write;
-    if (old_val)
+    if (old_val) {
+      this->count_eviction();
       evict_item(old_val);
+      count_window(window_evictions);
+    }
   }
 }
 
-template<size_t si, size_t a>
-void base_compacting_pool<si, a>::clear_cache() {
-  small_index head = stack_head.val;
+template<size_t si, size_t a, class src, class st>
+size_t base_compacting_pool<si, a, src, st>::alloc_bulk(void** out, size_t n) {
+  size_t got = 0;
+  while (got < n && current) {
+    out[got++] = current;
+    current = held_buffer[stack_head.val];
+    held_buffer[stack_head.val] = nullptr;
+    stack_head.dec();
+  }
+  collect_remote();
+  while (got < n) {
+    slab_header*& list = data_slabs[partial_slabs] ? data_slabs[partial_slabs]
+                                                   : data_slabs[full_slabs];
+    slab* s = static_cast<slab*>(list);
+    if (!s) {
+      if (!new_slab()) break;
+      continue;
+    }
+    got += take_objects(s, out + got, n - got);
+    if (s->num_open == 0) {
+      unlink_slab(s, list);
+      link_front(s, empty_slabs);
+    } else if (&list != &data_slabs[partial_slabs]) {
+      unlink_slab(s, list);
+      link_front(s, data_slabs[partial_slabs]);
+    }
+  }
+  for (size_t i = 0; i < got; i++) {
+    check_alloc(out[i]);
+    this->sample_alloc(out[i], sizeof(dummy_object));
+  }
+  this->count_allocs(got);
+  return got;
+}
+
+template<size_t si, size_t a, class src, class st>
+size_t base_compacting_pool<si, a, src, st>::take_objects(slab* s, void** out,
+                                                       size_t n) {
+  size_t to_take = s->num_open < n ? s->num_open : n;
+  s->num_open -= to_take;
+  void** end = out + to_take;
+  for (size_t w = to_take ? s->first_open_word() : mask_words;
+       out != end; w++) {
+    size_t available_set = s->open_bitmask[w];
+    while (available_set && out != end) {
+      *out++ = &s->members[w * bits_per_size
+                           + get_and_clear_first_set(&available_set)];
+    }
+    s->open_bitmask[w] = available_set;
+  }
+  return to_take;
+}
+
+template<size_t si, size_t a, class src, class st>
+void base_compacting_pool<si, a, src, st>::free_bulk(void* const* in, size_t n) {
+  this->count_frees(n);
+  for (size_t i = 0; i < n; i++) {
+    check_free(in[i]);
+    this->sample_free(in[i]);
+  }
+  size_t i = 0;
+  while (i < n) {
+    slab* s = slab::lookup_slab(in[i]);
+    if (shared && unlikely(s->owner != this)) {
+      remote_free(s, in[i++], shared_tag());
+      continue;
+    }
+    uint32_t old_open = s->num_open;
+    do {
+      s->return_object(in[i++]);
+    } while (i < n && slab::lookup_slab(in[i]) == s);
+    slab_header*& old_list = list_for(old_open);
+    if (&old_list != &list_for(s->num_open)) {
+      unlink_slab(s, old_list);
+      place_slab(s);
+    }
+  }
+}
+
+template<size_t si, size_t a, class src, class st>
+void base_compacting_pool<si, a, src, st>::clear_cache() {
+  small_index head = stack_head;
   stack_head.val = 0;
   if (current)
     evict_item(current);
+  current = nullptr;
   while (held_buffer[head.val]) {
     evict_item(held_buffer[head.val]);
     held_buffer[head.val] = nullptr;
@@ -229,14 +1104,67 @@ void base_compacting_pool<si, a>::clear_cache() {
   }
 }
 
-template<size_t si, size_t a>
-__attribute__ ((noinline)) void base_compacting_pool<si, a>::evict_item(void* old_val) {
+template<size_t si, size_t a, class src, class st>
+void base_compacting_pool<si, a, src, st>::prefetch(size_t n) const {
+  if (!n || !current) return;
+  __builtin_prefetch(current, 1);
+  small_index head = stack_head;
+  for (size_t i = 1; i < n && held_buffer[head.val]; i++) {
+    __builtin_prefetch(held_buffer[head.val], 1);
+    head.dec();
+  }
+}
+
+template<size_t si, size_t a, class src, class st>
+void base_compacting_pool<si, a, src, st>::set_cache_depth(size_t depth) {
+  uint32_t new_depth = min_cache_depth;
+  while (new_depth < depth && new_depth < max_cache_depth) new_depth *= 2;
+
+  // unwind the ring newest first, the window changes every index
+  void* kept[max_cache_depth];
+  size_t num_kept = 0;
+  small_index head = stack_head;
+  while (held_buffer[head.val]) {
+    kept[num_kept++] = held_buffer[head.val];
+    held_buffer[head.val] = nullptr;
+    head.dec();
+  }
+  size_t fits = num_kept < new_depth ? num_kept : new_depth;
+  for (size_t i = fits; i < num_kept; i++) evict_item(kept[i]);
+
+  // and rebuild it from the oldest object up
+  stack_head = small_index(0, new_depth - 1);
+  for (size_t i = fits; i > 0; i--) {
+    stack_head.inc();
+    held_buffer[stack_head.val] = kept[i - 1];
+  }
+}
+
+template<size_t si, size_t a, class src, class st>
+__attribute__ ((noinline))
+void base_compacting_pool<si, a, src, st>::adapt_depth() {
+  if (adaptive) {
+    if (window_refills && window_evictions) {
+      if (cache_depth() < max_cache_depth) set_cache_depth(cache_depth() * 2);
+    } else if (!window_refills) {
+      if (cache_depth() > min_cache_depth) set_cache_depth(cache_depth() / 2);
+    }
+  }
+  window_refills = 0;
+  window_evictions = 0;
+}
+
+template<size_t si, size_t a, class src, class st>
+__attribute__ ((noinline)) void base_compacting_pool<si, a, src, st>::evict_item(void* old_val) {
   // move common operations to a shared code space
-  ++evict_streak;
   slab* s = slab::lookup_slab(old_val);
-  bool was_empty = s->open_bitmask == 0;
+  if (shared && unlikely(s->owner != this)) {
+    remote_free(s, old_val, shared_tag());
+    return;
+  }
+  bool was_empty = s->num_open == 0;
   s->return_object(old_val);
-  bool val = s->open_bitmask == all_ones;
+  bool val = s->num_open == objects_per_slab;
   val |= was_empty;
 
   // Only have one branch on the main path
@@ -245,76 +1173,151 @@ __attribute__ ((noinline)) void base_compacting_pool<si, a>::evict_item(void* ol
     // empty slabs go to bottom of slab list
     // so that slabs evicted from the top are likely to be full
     // move slab from empty list to partial list
-    if (was_empty) {
-      remove_slab(s, empty_slabs);
-      slab* partial = data_slabs[partial_slabs];
-      if (partial) {
-        s->prev = partial->prev;
-        s->next = partial;
-        partial->prev = s;
-        if (s->prev) {
-          s->prev->next = s;
-        }
-      } else {
-        s->prev = s->next = nullptr;
-        data_slabs[partial_slabs] = s;
-      }
-    }
+    unlink_slab(s, was_empty ? empty_slabs : data_slabs[partial_slabs]);
+    place_slab(s);
+  }
+}
+
+template<size_t si, size_t a, class src, class st>
+void base_compacting_pool<si, a, src, st>::place_slab(slab* s) {
+  if (s->num_open == objects_per_slab) {
     // full branches will go to top of list
     // since occupancy is all the same and there's
-    // better cache properties
-    else {
-      remove_slab(s, data_slabs[partial_slabs]);
-      s->prev = nullptr;
-      slab* full = data_slabs[full_slabs];
-      s->next = full;
-      if (full) {
-        full->prev = s;
+    // better cache properties.
+    // Shared slabs go straight back to the source unless another
+    // pool is still in the middle of a remote free on them
+    if (shared && s->remote_idle()) {
+      release_slab(s);
+    } else {
+      link_front(s, data_slabs[full_slabs]);
+      if (unlikely(num_full() > retained_limit)) {
+        scavenge(num_full() - retained_limit);
       }
-      data_slabs[full_slabs] = s;
     }
+  } else if (s->num_open) {
+    link_back(s, data_slabs[partial_slabs]);
+  } else {
+    link_front(s, empty_slabs);
+  }
+}
+
+template<size_t si, size_t a, class src, class st>
+void base_compacting_pool<si, a, src, st>::remote_free(slab* s, void* obj,
+                                                   std::true_type) {
+  base_compacting_pool* owner = (base_compacting_pool*)s->owner;
+  size_t index = (dummy_object*)obj - &s->members[0];
+  size_t bit = (size_t)1 << (index % bits_per_size);
+  __atomic_fetch_add(&s->remote_inflight, 1, __ATOMIC_SEQ_CST);
+  __atomic_fetch_or(&s->remote_bitmask[index / bits_per_size], bit,
+                    __ATOMIC_SEQ_CST);
+  if (!__atomic_exchange_n(&s->remote_queued, 1, __ATOMIC_SEQ_CST)) {
+    slab_header* head = __atomic_load_n(&owner->remote_slabs, __ATOMIC_RELAXED);
+    slab_header* queued = s;
+    do {
+      s->remote_next = head;
+    } while (!__atomic_compare_exchange_n(&owner->remote_slabs, &head, queued, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+  __atomic_fetch_sub(&s->remote_inflight, 1, __ATOMIC_SEQ_CST);
+}
+
+template<size_t si, size_t a, class src, class st>
+__attribute__ ((noinline))
+void base_compacting_pool<si, a, src, st>::collect_remote(std::true_type) {
+  if (!__atomic_load_n(&remote_slabs, __ATOMIC_RELAXED)) {
+    return;
+  }
+  slab* s = static_cast<slab*>(__atomic_exchange_n(&remote_slabs, nullptr,
+                                                  __ATOMIC_ACQUIRE));
+  while (s) {
+    slab* next = (slab*)s->remote_next;
+    // clear before reading the bits, so a free which sets a bit
+    // after they are read queues the slab again
+    __atomic_store_n(&s->remote_queued, 0, __ATOMIC_SEQ_CST);
+    uint32_t old_open = s->num_open;
+    for (size_t w = 0; w < mask_words; w++) {
+      size_t bits = __atomic_exchange_n(&s->remote_bitmask[w], 0,
+                                        __ATOMIC_SEQ_CST);
+      s->open_bitmask[w] |= bits;
+      s->num_open += __builtin_popcountll(bits);
+    }
+    slab_header*& old_list = list_for(old_open);
+    if (&old_list != &list_for(s->num_open)
+        || s->num_open == objects_per_slab) {
+      unlink_slab(s, old_list);
+      place_slab(s);
+    }
+    s = next;
   }
 }
 
-template<size_t si, size_t a>
-void *base_compacting_pool<si, a>::get_from_slab_list() {
+template<size_t si, size_t a, class src, class st>
+void *base_compacting_pool<si, a, src, st>::get_from_slab_list() {
+  collect_remote();
   size_t which_slabs = partial_slabs;
-  slab* tryit = data_slabs[which_slabs];
+  slab_header* tryit = data_slabs[which_slabs];
   tryit = (tryit == nullptr) ? data_slabs[which_slabs ^= 1] : tryit;
-  // evict_streak = 0;
   if (unlikely(tryit == nullptr)) {
     return nullptr;
   }
-  void* rval = tryit->get_object();
-  if (tryit->open_bitmask) load_all(tryit);
-  //evict to empty region!
-  remove_slab(tryit, data_slabs[which_slabs]);
-  if (empty_slabs) {
-    empty_slabs->prev = tryit;
+  return refill_from(static_cast<slab*>(tryit), data_slabs[which_slabs]);
+}
+
+template<size_t si, size_t a, class src, class st>
+void *base_compacting_pool<si, a, src, st>::refill_from(slab* s, slab_header*& list) {
+  this->count_refill();
+  count_window(window_refills);
+  void* rval = s->get_object();
+  if (s->num_open) load_all(s);
+  if (s->num_open == 0) {
+    //evict to empty region!
+    unlink_slab(s, list);
+    link_front(s, empty_slabs);
+  }
+  // slabs with more objects than the cache holds stay partial
+  else if (&list != &data_slabs[partial_slabs]) {
+    unlink_slab(s, list);
+    link_front(s, data_slabs[partial_slabs]);
+  }
+  // the header and bitmask of the slab the next refill will use
+  slab_header* next = data_slabs[partial_slabs];
+  next = next ? next : data_slabs[full_slabs];
+  if (next) {
+    __builtin_prefetch(next, 1);
+    __builtin_prefetch(static_cast<slab*>(next)->open_bitmask, 1);
   }
-  tryit->next = empty_slabs;
-  empty_slabs = tryit;
-  assert(tryit->open_bitmask == 0);
   return rval;
 }
 
-template<size_t si, size_t a>
-void base_compacting_pool<si, a>::load_all(slab *s) {
-  uint64_t available_set = s->open_bitmask;
-  s->open_bitmask = 0;
-  assert(available_set);
-  while (true) {
-    uint64_t index = get_and_clear_first_set(&available_set);
-    void* value = &s->members[index];
-    *(volatile uint32_t*)value;
-    if (available_set) {
-      stack_head.inc();
-      held_buffer[stack_head.val] = value;
-    } else {
-      current = value;
-      break;
+template<size_t si, size_t a, class src, class st>
+void base_compacting_pool<si, a, src, st>::load_all(slab *s) {
+  // the refill fills the whole ring plus current
+  size_t refill_objects = cache_depth();
+  size_t to_load = s->num_open < refill_objects ? s->num_open : refill_objects;
+  s->num_open -= to_load;
+  assert(to_load);
+  // the ring is a stack, so the last objects loaded are allocated first.
+  // Those are prefetched, the rest are prefetched by alloc as it reaches
+  // them instead of being touched here while the caller waits
+  // small objects have 256/512 bit masks, so skip straight to the first
+  // word with open objects instead of testing the drained ones
+  for (size_t w = s->first_open_word();; w++) {
+    size_t available_set = s->open_bitmask[w];
+    while (available_set) {
+      size_t index = get_and_clear_first_set(&available_set);
+      void* value = &s->members[w * bits_per_size + index];
+      if (to_load <= refill_prefetch) __builtin_prefetch(value, 1);
+      if (--to_load) {
+        stack_head.inc();
+        held_buffer[stack_head.val] = value;
+      } else {
+        s->open_bitmask[w] = available_set;
+        current = value;
+        return;
+      }
     }
-  };
+    s->open_bitmask[w] = 0;
+  }
 }
 
 /// For global type_based pools, allows segregation
@@ -0,0 +1,322 @@
+#ifndef POOL_PROFILE_HPP
+#define POOL_PROFILE_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "pool_stats.hpp"
+#include "util.hpp"
+
+/// The process wide record of sampled allocations, which the pools using
+/// sampling_pool_stats report to. On average one allocation per
+/// sample_period bytes is sampled: its stack is taken by following the
+/// frame pointers (the makefile builds with -fno-omit-frame-pointer, code
+/// built without them shows up as cut short stacks) and it is tracked
+/// until freed.
+///
+/// write_profile dumps the live samples as a heap_v2 profile, the legacy
+/// text format which pprof reads and scales by the sample period:
+///
+///     pprof --text ./program heap.prof
+///
+/// Only sampled objects ever take the lock, everything else costs the
+/// pools a decrement and compare per alloc and a table load per free
+class heap_profiler {
+public:
+
+  constexpr static size_t max_depth = 32;
+  constexpr static size_t default_period = 512 * 1024;
+
+  /// The profiler is never destroyed, so pools may free objects from
+  /// static destructors
+  static heap_profiler& get() {
+    static heap_profiler* p = new heap_profiler();
+    return *p;
+  }
+
+  /// Sets the mean bytes allocated between samples, 0 stops sampling.
+  /// A pool picks the change up once it takes its next sample, so this
+  /// is best called before the pools allocate
+  void set_sample_period(size_t bytes) {
+    period.store(bytes, std::memory_order_relaxed);
+  }
+
+  size_t sample_period() const {
+    return period.load(std::memory_order_relaxed);
+  }
+
+  /// Bytes to allocate before the next sample, drawn from the
+  /// exponential distribution so that samples land uniformly per byte
+  int64_t next_distance(uint64_t& rng) const {
+    size_t mean = sample_period();
+    if (!mean) {
+      return INT64_MAX;
+    }
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    // 53 random bits, in (0, 1]
+    double u = ((rng >> 11) + 1) * (1.0 / (1ull << 53));
+    double d = -log(u) * mean;
+    return d < (double)INT64_MAX ? (int64_t)d : INT64_MAX;
+  }
+
+  /// Seeds the sample distances of one pool
+  uint64_t seed(const void* pool) {
+    uint64_t s = (uint64_t)(size_t)pool
+                 ^ (seeds.fetch_add(1, std::memory_order_relaxed)
+                    * 0x9e3779b97f4a7c15ull);
+    return s ? s : 1;
+  }
+
+  /// Whether obj may be a sampled object, a single load
+  bool maybe_sampled(const void* obj) const {
+    return filter[slot(obj)].load(std::memory_order_relaxed) != 0;
+  }
+
+  void record(void* obj, size_t bytes);
+  void forget(void* obj);
+  void move(void* from, void* to);
+
+  /// The number of sampled objects still live
+  size_t live_samples();
+
+  /// Writes the live samples as a heap profile, followed by the mappings
+  /// pprof needs for symbols. Returns false when writing fails
+  bool write_profile(FILE* out);
+  bool write_profile(const char* path);
+
+private:
+
+  constexpr static size_t filter_slots = 4096;
+
+  struct stack_bucket {
+    size_t live_objects = 0;
+    size_t live_bytes = 0;
+    size_t total_objects = 0;
+    size_t total_bytes = 0;
+  };
+
+  struct sample {
+    stack_bucket* bucket;
+    size_t bytes;
+  };
+
+  std::atomic<size_t> period;
+  std::atomic<uint64_t> seeds;
+  // how many live samples hash to each slot, so frees of objects which
+  // were never sampled skip the lock. Counts are only changed under
+  // the lock, and a slot which saturates stays set
+  std::atomic<uint8_t> filter[filter_slots];
+
+  std::mutex lock;
+  std::map<std::vector<void*>, stack_bucket> stacks;
+  std::unordered_map<void*, sample> live;
+
+  heap_profiler() : period(default_period), seeds(0) {
+    for (auto& count : filter) {
+      count.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  static size_t slot(const void* obj) {
+    size_t p = (size_t)obj;
+    return ((p >> 4) ^ (p >> 16)) & (filter_slots - 1);
+  }
+
+  void filter_add(void* obj, int n) {
+    std::atomic<uint8_t>& count = filter[slot(obj)];
+    uint8_t c = count.load(std::memory_order_relaxed);
+    if (c != UINT8_MAX) {
+      count.store(c + n, std::memory_order_relaxed);
+    }
+  }
+
+  void drop(std::unordered_map<void*, sample>::iterator it) {
+    it->second.bucket->live_objects -= 1;
+    it->second.bucket->live_bytes -= it->second.bytes;
+    filter_add(it->first, -1);
+    live.erase(it);
+  }
+
+  static size_t frame_pointer_stack(void** out, size_t max, size_t skip);
+};
+
+/// A stats policy which samples allocations into heap_profiler on top of
+/// the stats policy it wraps. For instance
+///
+///     base_compacting_pool<sizeof(node), alignof(node), malloc_slab_source,
+///                          sampling_pool_stats<counting_pool_stats>>
+template <class stats = no_pool_stats>
+class sampling_pool_stats : public stats {
+  heap_profiler* profiler;
+  uint64_t rng;
+  int64_t bytes_until_sample;
+
+  __attribute__ ((noinline, cold)) void take_sample(void* obj, size_t bytes) {
+    profiler->record(obj, bytes);
+    bytes_until_sample = profiler->next_distance(rng);
+  }
+
+public:
+
+  sampling_pool_stats() : profiler(&heap_profiler::get()) {
+    rng = profiler->seed(this);
+    bytes_until_sample = profiler->next_distance(rng);
+  }
+
+  void sample_alloc(void* obj, size_t bytes) {
+    if (unlikely((bytes_until_sample -= bytes) < 0)) {
+      take_sample(obj, bytes);
+    }
+  }
+
+  void sample_free(void* obj) {
+    if (unlikely(profiler->maybe_sampled(obj))) {
+      profiler->forget(obj);
+    }
+  }
+
+  void sample_free_run(void* first, size_t n, size_t stride) {
+    for (size_t i = 0; i < n; i++) {
+      sample_free((char*)first + i * stride);
+    }
+  }
+
+  void sample_move(void* from, void* to) {
+    if (unlikely(profiler->maybe_sampled(from))) {
+      profiler->move(from, to);
+    }
+  }
+};
+
+// Walks the saved frame pointers: each frame starts with the caller's
+// frame pointer followed by the return address, on x86-64 and aarch64
+// alike. The walk stops at anything which doesn't look like a frame
+// further up the same stack
+inline __attribute__ ((noinline))
+size_t heap_profiler::frame_pointer_stack(void** out, size_t max, size_t skip) {
+  void** fp = (void**)__builtin_frame_address(0);
+  size_t n = 0;
+  while (fp && n < max) {
+    void* ret = fp[1];
+    if (!ret) {
+      break;
+    }
+    if (skip) {
+      --skip;
+    } else {
+      out[n++] = ret;
+    }
+    void** next = (void**)fp[0];
+    if (next <= fp || (size_t)((char*)next - (char*)fp) > ((size_t)1 << 20)
+        || ((size_t)next & (sizeof(void*) - 1))) {
+      break;
+    }
+    fp = next;
+  }
+  return n;
+}
+
+inline __attribute__ ((noinline))
+void heap_profiler::record(void* obj, size_t bytes) {
+  void* pcs[max_depth];
+  // leaves out record itself and the pool's take_sample
+  size_t depth = frame_pointer_stack(pcs, max_depth, 2);
+  std::vector<void*> key(pcs, pcs + depth);
+  std::lock_guard<std::mutex> guard(lock);
+  stack_bucket& bucket = stacks[key];
+  bucket.live_objects += 1;
+  bucket.live_bytes += bytes;
+  bucket.total_objects += 1;
+  bucket.total_bytes += bytes;
+  // a sample left behind by a pool destroyed with live objects
+  auto stale = live.find(obj);
+  if (stale != live.end()) {
+    drop(stale);
+  }
+  live[obj] = sample{&bucket, bytes};
+  filter_add(obj, 1);
+}
+
+inline __attribute__ ((noinline))
+void heap_profiler::forget(void* obj) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = live.find(obj);
+  if (it != live.end()) {
+    drop(it);
+  }
+}
+
+inline __attribute__ ((noinline))
+void heap_profiler::move(void* from, void* to) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = live.find(from);
+  if (it == live.end()) {
+    return;
+  }
+  sample moved = it->second;
+  drop(it);
+  moved.bucket->live_objects += 1;
+  moved.bucket->live_bytes += moved.bytes;
+  live[to] = moved;
+  filter_add(to, 1);
+}
+
+inline size_t heap_profiler::live_samples() {
+  std::lock_guard<std::mutex> guard(lock);
+  return live.size();
+}
+
+inline bool heap_profiler::write_profile(FILE* out) {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stack_bucket total;
+    for (const auto& entry : stacks) {
+      total.live_objects += entry.second.live_objects;
+      total.live_bytes += entry.second.live_bytes;
+      total.total_objects += entry.second.total_objects;
+      total.total_bytes += entry.second.total_bytes;
+    }
+    fprintf(out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+            total.live_objects, total.live_bytes, total.total_objects,
+            total.total_bytes, sample_period());
+    for (const auto& entry : stacks) {
+      const stack_bucket& b = entry.second;
+      fprintf(out, "%zu: %zu [%zu: %zu] @", b.live_objects, b.live_bytes,
+              b.total_objects, b.total_bytes);
+      for (void* pc : entry.first) {
+        fprintf(out, " %p", pc);
+      }
+      fputc('\n', out);
+    }
+  }
+  fputs("\nMAPPED_LIBRARIES:\n", out);
+  FILE* maps = fopen("/proc/self/maps", "r");
+  if (maps) {
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), maps)) > 0) {
+      fwrite(buf, 1, n, out);
+    }
+    fclose(maps);
+  }
+  return !ferror(out);
+}
+
+inline bool heap_profiler::write_profile(const char* path) {
+  FILE* out = fopen(path, "w");
+  if (!out) {
+    return false;
+  }
+  bool ok = write_profile(out);
+  return fclose(out) == 0 && ok;
+}
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef POOL_STATS_HPP
+#define POOL_STATS_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+/// A snapshot of one pool, see base_compacting_pool::get_stats.
+/// The event counters stay zero unless the pool counts them
+struct pool_stats {
+  uint64_t allocs = 0;
+  /// allocations served straight from the ring buffer
+  uint64_t cache_hits = 0;
+  uint64_t frees = 0;
+  /// objects pushed out of a full ring buffer back into their slab
+  uint64_t evictions = 0;
+  /// times the empty cache was loaded from a slab
+  uint64_t refills = 0;
+  uint64_t slabs_created = 0;
+  uint64_t slabs_released = 0;
+  /// objects moved by compact
+  uint64_t relocations = 0;
+
+  size_t empty_slabs = 0;
+  size_t partial_slabs = 0;
+  size_t full_slabs = 0;
+  /// memory held in slabs, and the part of it in fully free slabs
+  size_t bytes_retained = 0;
+  size_t bytes_free = 0;
+};
+
+/// What a heap walk found, see base_compacting_pool::walk_heap. The
+/// regions' slabs aren't walked, and objects freed into a shared slab by
+/// another pool count as live until the owner collects them
+struct heap_report {
+  constexpr static size_t density_buckets = 8;
+
+  size_t slabs = 0;
+  /// allocated objects, not counting the ones held in the cache
+  size_t live_objects = 0;
+  size_t cached_objects = 0;
+  /// slabs by the fraction of their objects allocated (cached ones
+  /// included), the first bucket being the emptiest
+  size_t density[density_buckets] = {};
+
+  size_t bytes_live = 0;
+  size_t bytes_cached = 0;
+  /// free objects in slabs which still hold allocated ones, what
+  /// compaction could give back
+  size_t bytes_fragmented = 0;
+  /// fully free slabs
+  size_t bytes_free_slabs = 0;
+  /// slab headers, bitmasks and the tail which fits no object
+  size_t bytes_overhead = 0;
+};
+
+/// A counter which only one thread writes but any thread may read.
+/// The increment is a plain load and store, with no locked instruction
+class relaxed_counter {
+  std::atomic<uint64_t> value;
+
+public:
+  relaxed_counter() : value(0) {}
+
+  void add(uint64_t n) {
+    value.store(value.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+  }
+
+  void sub(uint64_t n) { add(0 - n); }
+
+  void set(uint64_t n) { value.store(n, std::memory_order_relaxed); }
+
+  uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+/// The stats parameter of base_compacting_pool. no_pool_stats compiles
+/// every hook away, counting_pool_stats counts the events on the hot path
+/// and sampling_pool_stats (pool_profile.hpp) samples allocations for a
+/// heap profile. The sample hooks see every object handed out, taken
+/// back or moved by compact. sample_free_run takes back n objects stride
+/// bytes apart at once, for a region's slab
+struct no_pool_stats {
+  void count_alloc() {}
+  void count_cache_hit() {}
+  void count_free() {}
+  void count_eviction() {}
+  void count_refill() {}
+  void count_allocs(size_t) {}
+  void count_frees(size_t) {}
+  void count_slab_created() {}
+  void count_slab_released() {}
+  void count_relocations(size_t) {}
+  void sample_alloc(void*, size_t) {}
+  void sample_free(void*) {}
+  void sample_free_run(void*, size_t, size_t) {}
+  void sample_move(void*, void*) {}
+  void read_counters(pool_stats&) const {}
+};
+
+struct counting_pool_stats {
+  relaxed_counter allocs, cache_hits, frees, evictions, refills;
+  relaxed_counter slabs_created, slabs_released, relocations;
+
+  void count_alloc() { allocs.add(1); }
+  void count_cache_hit() { cache_hits.add(1); }
+  void count_free() { frees.add(1); }
+  void count_eviction() { evictions.add(1); }
+  void count_refill() { refills.add(1); }
+  void count_allocs(size_t n) { allocs.add(n); }
+  void count_frees(size_t n) { frees.add(n); }
+  void count_slab_created() { slabs_created.add(1); }
+  void count_slab_released() { slabs_released.add(1); }
+  void count_relocations(size_t n) { relocations.add(n); }
+  void sample_alloc(void*, size_t) {}
+  void sample_free(void*) {}
+  void sample_free_run(void*, size_t, size_t) {}
+  void sample_move(void*, void*) {}
+
+  void read_counters(pool_stats& out) const {
+    out.allocs = allocs.get();
+    out.cache_hits = cache_hits.get();
+    out.frees = frees.get();
+    out.evictions = evictions.get();
+    out.refills = refills.get();
+    out.slabs_created = slabs_created.get();
+    out.slabs_released = slabs_released.get();
+    out.relocations = relocations.get();
+  }
+};
+
+#endif
@@ -25,53 +25,83 @@ typedef union chunk {
     char data[1]; //char c[] not allowed in union
 } chunk;
 
+// Sits at the start of every slab, the chunks follow it. Slabs are
+// slab_bytes long and aligned to it, so masking a chunk finds its slab
 typedef struct slab {
     struct slab *next;
-    chunk *data;
+    // the malloc'd group, only set in the first slab of each group
+    void *group;
 } slab;
 
-static slab* create_slab_data(size_t blob_size,
-                              uint32_t num_blobs) {
-    void *full_blob = malloc(blob_size * num_blobs + sizeof(slab));
-    if (full_blob != NULL) {
-        chunk *cur_blob = full_blob;
-        for(uint32_t i = 0; i < num_blobs - 1; i++) {
-            void *next = ((char *) cur_blob + blob_size);
-            cur_blob->next = next;
-            cur_blob = next;
-        }
-        cur_blob->next = NULL;
-        slab *retslab = (slab *)((char *)full_blob + blob_size * num_blobs);
-        retslab->data = full_blob;
-        return retslab;
-    }
-    
-    return NULL;
-}
+#define MIN_SLAB_BYTES 4096
+#define DEFAULT_UNITS 64
 
-static inline void *unchecked_alloc(struct unfixed_block *inblock) {
-    chunk *first_open = inblock->first_open;
-    void *data = first_open->data;
-    inblock->first_open = first_open->next;
-    return data;
+// Slabs are cut from groups of this many, malloc'd with a slab of slack
+// for the alignment. posix_memalign per slab would waste about a slab
+// for every slab, and pages of the group are only touched once used
+#define SLABS_PER_GROUP 16
+
+static inline slab *slab_of(const struct unfixed_block *inblock, void *ptr) {
+    return (slab *)((size_t)ptr & ~(inblock->slab_bytes - 1));
 }
 
-static noinline void *alloc_slab(struct unfixed_block *inblock) {
-    slab *newslab = create_slab_data(inblock->data_size,
-                                     inblock->unit_num);
-    if (newslab == NULL)
-        return NULL;
+// Chunks are carved off the new slab by the bump pointer as they are
+// needed, nothing is written to them up front
+static noinline int add_slab(struct unfixed_block *inblock) {
+    slab *newslab;
+    if (inblock->group_next != inblock->group_end) {
+        newslab = (slab *)inblock->group_next;
+        newslab->group = NULL;
+    } else {
+        size_t bytes = inblock->slab_bytes;
+        void *group = malloc(bytes * (SLABS_PER_GROUP + 1));
+        if (group == NULL)
+            return 0;
+        newslab = (slab *)(((size_t)group + bytes - 1) & ~(bytes - 1));
+        newslab->group = group;
+        inblock->group_end = (char *)newslab + bytes * SLABS_PER_GROUP;
+    }
+    inblock->group_next = (char *)newslab + inblock->slab_bytes;
     newslab->next = inblock->partial;
     inblock->partial = newslab;
-    inblock->first_open = newslab->data;
-    return unchecked_alloc(inblock);
+    inblock->bump = (char *)(newslab + 1);
+    inblock->bump_end = inblock->bump + inblock->data_size * inblock->unit_num;
+    return 1;
+}
+
+static noinline void *alloc_bump(struct unfixed_block *inblock) {
+    if (inblock->bump == inblock->bump_end && !add_slab(inblock))
+        return NULL;
+    void *data = inblock->bump;
+    inblock->bump += inblock->data_size;
+    return data;
 }
 
 void *block_alloc(struct unfixed_block *inblock) {
-    if (FAST_ALLOC_PREDICT_NOT(!inblock->first_open))
-        return alloc_slab(inblock);
-    
-    return unchecked_alloc(inblock);
+    chunk *first_open = inblock->first_open;
+    if (FAST_ALLOC_PREDICT_NOT(!first_open))
+        return alloc_bump(inblock);
+
+    inblock->first_open = first_open->next;
+    return first_open->data;
+}
+
+void *block_alloc_hint(struct unfixed_block *inblock, void *hint) {
+    if (hint == NULL)
+        return block_alloc(inblock);
+    slab *near = slab_of(inblock, hint);
+    chunk *first_open = inblock->first_open;
+    // a free chunk in the hint's slab if one is at hand, otherwise fresh
+    // memory right after the hint's neighbours - the list isn't searched
+    if (first_open && slab_of(inblock, first_open) == near) {
+        inblock->first_open = first_open->next;
+        return first_open->data;
+    }
+    if (inblock->bump != inblock->bump_end
+        && slab_of(inblock, inblock->bump) == near) {
+        return alloc_bump(inblock);
+    }
+    return block_alloc(inblock);
 }
 
 void block_free(struct unfixed_block *inblock, void *ptr) {
@@ -86,24 +116,40 @@ struct unfixed_block create_unfixed_block(size_t unit_size, size_t unit_num) {
     struct unfixed_block blk;
     blk.partial = NULL;
     blk.first_open = NULL;
+    blk.bump = NULL;
+    blk.bump_end = NULL;
+    blk.group_next = NULL;
+    blk.group_end = NULL;
     blk.data_size = pad_size(unit_size);
-    blk.unit_num = unit_num < 2 ? 2 : unit_num;
+    size_t wanted = unit_num < 2 ? (unit_num ? 2 : DEFAULT_UNITS) : unit_num;
+    blk.slab_bytes = MIN_SLAB_BYTES;
+    while (blk.slab_bytes < sizeof(slab) + blk.data_size * wanted)
+        blk.slab_bytes *= 2;
+    // whatever is left of the power of two holds more units
+    blk.unit_num = (blk.slab_bytes - sizeof(slab)) / blk.data_size;
     return blk;
 }
 
+// Slabs are listed newest first, so the first slab of a group (which
+// frees the whole group) comes after the rest of that group
 static size_t free_slab_ring(slab *inslab) {
     size_t num = 0;
     while(inslab) {
         num++;
-        void *free_ptr = inslab->data;
+        void *free_ptr = inslab->group;
         inslab = inslab->next;
         free(free_ptr);
-    } 
+    }
     return num;
 }
 
-void destroy_unfixed_block(struct unfixed_block* blk) {
-    size_t part = free_slab_ring(blk->partial);
-    blk->partial =  NULL;
+size_t destroy_unfixed_block(struct unfixed_block* blk) {
+    size_t released = free_slab_ring(blk->partial);
+    blk->partial = NULL;
     blk->first_open = NULL;
+    blk->bump = NULL;
+    blk->bump_end = NULL;
+    blk->group_next = NULL;
+    blk->group_end = NULL;
+    return released;
 }
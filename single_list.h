@@ -9,19 +9,36 @@ struct alloc_type {
     void (*free)(struct alloc_type *, void *);
 };
 
+// A plain freelist allocator for one size, the baseline the compacting
+// pools are measured against. Freed chunks go on a LIFO list, and new
+// slabs are carved up lazily by a bump pointer instead of being linked up
+// front. Slabs are a power of two in size and aligned to it, and are
+// cut from larger groups so the alignment costs little memory
 struct unfixed_block {
     void *first_open;
+    // the untouched tail of the newest slab
+    char *bump;
+    char *bump_end;
+    // the slabs of the newest group not handed out yet
+    char *group_next;
+    char *group_end;
+    // every slab, newest first
     struct slab *partial;
     size_t data_size;
+    // chunks per slab, at least what was asked for
     size_t unit_num;
+    size_t slab_bytes;
 };
 
 extern struct alloc_type *default_alloc;
 
 void *block_alloc(struct unfixed_block *inblock);
+// Prefers a chunk in the same slab as hint, hint may be NULL
 void *block_alloc_hint(struct unfixed_block *inblock, void *hint);
 void block_free(struct unfixed_block *inblock, void *ptr);
 
+// unit_num 0 picks a slab of a page or more holding at least 64 units
 struct unfixed_block create_unfixed_block(size_t unit_size, size_t unit_num);
-void destroy_unfixed_block(struct unfixed_block *blk);
+// Frees every slab, returns how many there were
+size_t destroy_unfixed_block(struct unfixed_block *blk);
 #endif
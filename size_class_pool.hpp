@@ -0,0 +1,194 @@
+#ifndef SIZE_CLASS_POOL_HPP
+#define SIZE_CLASS_POOL_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include "pool.hpp"
+
+/// Wraps a slab source so every pool asks it for spans of the same size
+template <class slab_source, size_t span>
+struct fixed_span_source : slab_source {
+  constexpr static size_t min_slab_bytes = span;
+
+  fixed_span_source(slab_source src = slab_source()) : slab_source(src) {}
+};
+
+/// The sizes of a size_class_pool, ascending multiples of 16, which all
+/// share slabs of span bytes
+template <size_t span, size_t... sizes>
+struct size_class_set {};
+
+constexpr size_t last_size_of(size_t size) { return size; }
+
+template <class... rest>
+constexpr size_t last_size_of(size_t, rest... others) {
+  return last_size_of(others...);
+}
+
+/// 16 to 1024 bytes, four classes per doubling
+typedef size_class_set<16384, 16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224,
+                       256, 320, 384, 448, 512, 640, 768, 896, 1024>
+  small_size_classes;
+
+/// Routes variable-sized requests to one base_compacting_pool per size class
+/// Parameters:
+///     slab_source: Where slab memory comes from, see malloc_slab_source
+///     classes: A size_class_set, small_size_classes by default
+///
+/// Every class is aligned to the largest power of two dividing its size,
+/// from 16 bytes up to max_class_align, so requests for a bigger alignment
+/// are served by the first class which is a multiple of it (see alloc with
+/// an alignment). All classes use slabs of span_bytes, so
+/// the slab of any object is still found with a single AND, and the
+/// object_size in its header says which pool it came from - free doesn't
+/// need the size.
+///
+/// The pools are not thread safe, and neither is this (see malloc_shim.cpp)
+template <class slab_source = malloc_slab_source,
+          class classes = small_size_classes>
+class size_class_pool;
+
+template <class slab_source, size_t span, size_t... sizes>
+class size_class_pool<slab_source, size_class_set<span, sizes...>> {
+
+public:
+
+  constexpr static size_t span_bytes = span;
+  /// The alignment every class has, and the most any class has
+  constexpr static size_t class_align = 16;
+  constexpr static size_t max_class_align = 4096;
+  constexpr static size_t max_size = last_size_of(sizes...);
+  constexpr static size_t num_classes = sizeof...(sizes);
+
+  static_assert(num_classes <= 256, "class indices must fit a byte");
+
+  /// The alignment of the objects of a class of size bytes
+  constexpr static size_t alignment_of(size_t size) {
+    return (size & (0 - size)) < max_class_align ? size & (0 - size)
+                                                  : max_class_align;
+  }
+
+private:
+
+  typedef fixed_span_source<slab_source, span_bytes> span_source;
+
+  // type-erased handle on one of the pools
+  struct class_entry {
+    void* pool;
+    size_t size;
+    void* (*alloc)(void*);
+    void (*free)(void*, void*);
+    void (*clear_cache)(void*);
+    void (*clean)(void*);
+  };
+
+  template <size_t index, size_t... list>
+  struct class_list {
+    class_list(slab_source) {}
+    void fill(class_entry*) {}
+  };
+
+  template <size_t index, size_t size, size_t... rest>
+  struct class_list<index, size, rest...> : class_list<index + 1, rest...> {
+    typedef base_compacting_pool<size, alignment_of(size), span_source>
+      pool_type;
+
+    static_assert(size % class_align == 0,
+                  "class sizes must be multiples of class_align");
+    static_assert(pool_type::slab_bytes == span_bytes,
+                  "size classes must share one span size");
+
+    pool_type pool;
+
+    class_list(slab_source src) : class_list<index + 1, rest...>(src),
+                                  pool(span_source(src)) {}
+
+    static void* alloc(void* p) { return ((pool_type*)p)->alloc(); }
+    static void free(void* p, void* obj) { ((pool_type*)p)->free(obj); }
+    static void clear_cache(void* p) { ((pool_type*)p)->clear_cache(); }
+    static void clean(void* p) { ((pool_type*)p)->clean(); }
+
+    void fill(class_entry* entries) {
+      entries[index] = {&pool, size, alloc, free, clear_cache, clean};
+      class_list<index + 1, rest...>::fill(entries);
+    }
+  };
+
+  typedef class_list<0, sizes...> all_classes;
+
+  // indexed by the size in class_align units, rounded up
+  uint8_t size_to_class[max_size / class_align + 1];
+  class_entry entries[num_classes];
+  all_classes pools;
+
+public:
+
+  size_class_pool(slab_source src = slab_source()) : pools(src) {
+    pools.fill(entries);
+    size_t cls = 0;
+    for (size_t i = 0; i <= max_size / class_align; i++) {
+      while (entries[cls].size < i * class_align) ++cls;
+      size_to_class[i] = cls;
+    }
+  }
+
+  size_class_pool(const size_class_pool&) = delete;
+  size_class_pool& operator=(const size_class_pool&) = delete;
+
+  /// The class serving bytes, only valid for bytes <= max_size
+  size_t class_of(size_t bytes) const {
+    return size_to_class[(bytes + class_align - 1) / class_align];
+  }
+
+  /// The class of an object allocated from any size_class_pool
+  size_t class_of_object(void* obj) const {
+    return size_to_class[usable_size(obj) / class_align];
+  }
+
+  /// The smallest class serving bytes whose objects are aligned to
+  /// align, a power of two, or num_classes when there is none
+  size_t class_of(size_t bytes, size_t align) const {
+    if (bytes > max_size || align > max_class_align) return num_classes;
+    size_t cls = class_of(bytes);
+    while (cls < num_classes && entries[cls].size % align) ++cls;
+    return cls;
+  }
+
+  size_t class_size(size_t cls) const { return entries[cls].size; }
+
+  /// The bytes actually available at obj - the size of its class
+  static size_t usable_size(void* obj) {
+    return ((slab_header*)((size_t)obj & ~(span_bytes - 1)))->object_size;
+  }
+
+  void* alloc_class(size_t cls) {
+    return entries[cls].alloc(entries[cls].pool);
+  }
+
+  void free_class(size_t cls, void* obj) {
+    entries[cls].free(entries[cls].pool, obj);
+  }
+
+  /// Returns nullptr for requests over max_size
+  void* alloc(size_t bytes) {
+    return bytes <= max_size ? alloc_class(class_of(bytes)) : nullptr;
+  }
+
+  /// Returns nullptr when no class fits, see class_of
+  void* alloc(size_t bytes, size_t align) {
+    size_t cls = class_of(bytes, align);
+    return cls < num_classes ? alloc_class(cls) : nullptr;
+  }
+
+  void free(void* obj) { free_class(class_of_object(obj), obj); }
+
+  void clear_cache() {
+    for (auto& e : entries) e.clear_cache(e.pool);
+  }
+
+  void clean() {
+    for (auto& e : entries) e.clean(e.pool);
+  }
+};
+
+#endif
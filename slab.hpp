@@ -0,0 +1,510 @@
+#ifndef SLAB_HPP
+#define SLAB_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <linux/mempolicy.h>
+#include <mutex>
+#include "util.hpp"
+
+#if defined(__SANITIZE_ADDRESS__)
+#define POOL_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define POOL_ASAN 1
+#endif
+#endif
+
+#if defined(POOL_ASAN)
+#include <sanitizer/asan_interface.h>
+#endif
+
+/// The slab backend shared by base_compacting_pool (pool.hpp) and the
+/// runtime-sized compacting_pool (compacting_pool.h).
+///
+/// A slab is a power-of-two sized span aligned to its own size, so the
+/// slab of any object is found with a single AND. Every slab starts with
+/// a slab_header, followed by the open bitmask (a set bit is a free object)
+/// and then the objects themselves:
+///
+///   [slab_header][remote header, shared slabs only][open bitmask][objects]
+///
+/// The template pool knows the geometry at compile time, the runtime pool
+/// computes the same numbers from a size_align when it is constructed.
+
+struct slab_header {
+  slab_header *next, *prev;
+  void* owner;
+  uint32_t num_open;
+  // distance between objects, which also identifies the size class
+  uint32_t object_size;
+#if defined(COMPACTING_POOL_HARDENED)
+  // pool_debug::slab_magic mixed with the slab's address
+  uint64_t magic;
+#endif
+};
+
+/// Debug support for base_compacting_pool, all of which compiles away
+/// unless the pool is built hardened or under AddressSanitizer.
+///
+/// With COMPACTING_POOL_HARDENED, slabs carry a magic word which every
+/// lookup checks, so a pointer from another allocator is caught instead
+/// of corrupting whatever it lands on. Free objects are filled with
+/// poison_byte, and alloc checks the fill is still intact - a write
+/// after free shows up on the next allocation of that object. Frees
+/// check the object's open bit, and when the object is already poisoned
+/// they also look for it in the cache, which catches double frees
+/// before the same pointer is cached twice.
+///
+/// Under AddressSanitizer, free objects are poisoned in the shadow
+/// memory as well, so any access to them is reported where it happens.
+namespace pool_debug {
+
+#if defined(COMPACTING_POOL_HARDENED)
+constexpr bool hardened = true;
+#else
+constexpr bool hardened = false;
+#endif
+
+constexpr unsigned char poison_byte = 0xdf;
+constexpr uint64_t slab_magic = 0x5a1b5a1b0bad5eedull;
+
+static inline uint64_t magic_of(const void* slab) {
+  return slab_magic ^ (uint64_t)(uintptr_t)slab;
+}
+
+static inline void fill(void* p, size_t bytes) {
+  memset(p, poison_byte, bytes);
+}
+
+static inline bool is_filled(const void* p, size_t bytes) {
+  const unsigned char* bytes_at = (const unsigned char*)p;
+  for (size_t i = 0; i < bytes; i++) {
+    if (bytes_at[i] != poison_byte) return false;
+  }
+  return true;
+}
+
+static inline void asan_poison(const void* p, size_t bytes) {
+#if defined(POOL_ASAN)
+  ASAN_POISON_MEMORY_REGION(p, bytes);
+#else
+  (void)p;
+  (void)bytes;
+#endif
+}
+
+static inline void asan_unpoison(const void* p, size_t bytes) {
+#if defined(POOL_ASAN)
+  ASAN_UNPOISON_MEMORY_REGION(p, bytes);
+#else
+  (void)p;
+  (void)bytes;
+#endif
+}
+
+} // namespace pool_debug
+
+namespace pool_geometry {
+
+constexpr size_t bits_per_word = sizeof(size_t) * 8;
+
+/// Slabs are never smaller than a page, and grow in powers of two
+/// until they can hold at least min_slab_objects objects
+constexpr size_t min_slab_bytes = 4096;
+constexpr size_t min_slab_objects = 8;
+
+constexpr size_t round_up(size_t val, size_t to) {
+  return (val + to - 1) / to * to;
+}
+
+constexpr size_t max_of(size_t a, size_t b) { return a > b ? a : b; }
+
+/// Bytes in front of the first object (header and bitmask words) once
+/// padded out to the object alignment. Slabs shared between pools also
+/// carry a remote free bitmask
+constexpr size_t header_bytes(size_t words, size_t align, bool shared) {
+  return round_up(sizeof(slab_header) + words * sizeof(size_t)
+                  + (shared ? words * sizeof(size_t) + sizeof(void*)
+                              + 2 * sizeof(uint32_t)
+                            : 0),
+                  max_of(align, sizeof(size_t)));
+}
+
+/// Upper bound on the bitmask words - computed with a one-word header,
+/// so it can only overestimate the object count
+constexpr size_t mask_words(size_t bytes, size_t stride, size_t align,
+                            bool shared) {
+  return ((bytes - header_bytes(1, align, shared)) / stride + bits_per_word - 1)
+         / bits_per_word;
+}
+
+constexpr size_t objects_in(size_t bytes, size_t stride, size_t align,
+                            bool shared) {
+  return (bytes - header_bytes(mask_words(bytes, stride, align, shared),
+                               align, shared)) / stride;
+}
+
+constexpr size_t slab_bytes(size_t stride, size_t align, bool shared,
+                            size_t bytes = min_slab_bytes) {
+  return objects_in(bytes, stride, align, shared) >= min_slab_objects
+         ? bytes
+         : slab_bytes(stride, align, shared, bytes * 2);
+}
+
+/// Lets other pools free into a slab without touching the owner's bitmask.
+/// A remote free counts itself in flight, sets its bit here, and queues the
+/// slab on the owner unless it is already queued. The owner only hands a
+/// slab back to the source once no remote free is still in flight on it
+/// and it isn't queued - a free in flight can queue a slab the owner has
+/// already collected, and it must stay the owner's until it is collected
+/// again
+template <size_t words>
+struct remote_header {
+  size_t remote_bitmask[words];
+  void* remote_next;
+  uint32_t remote_queued;
+  uint32_t remote_inflight;
+
+  void init_remote() {
+    for (auto& word : remote_bitmask) word = 0;
+    remote_next = nullptr;
+    remote_queued = 0;
+    remote_inflight = 0;
+  }
+
+  bool remote_idle() const {
+    return !__atomic_load_n(&remote_inflight, __ATOMIC_SEQ_CST)
+           && !__atomic_load_n(&remote_queued, __ATOMIC_SEQ_CST);
+  }
+};
+
+struct no_remote_header {
+  void init_remote() {}
+  bool remote_idle() const { return true; }
+};
+
+} // namespace pool_geometry
+
+/// Maps bytes bytes aligned to align straight from the kernel,
+/// by over-mapping and trimming off the misaligned ends
+static inline void* map_aligned(size_t bytes, size_t align) {
+  size_t len = bytes + align;
+  char* p = (char*)mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    return nullptr;
+  }
+  char* aligned = (char*)(((size_t)p + align - 1) & ~(align - 1));
+  if (aligned != p) {
+    munmap(p, aligned - p);
+  }
+  size_t tail = (p + len) - (aligned + bytes);
+  if (tail) {
+    munmap(aligned + bytes, tail);
+  }
+  return aligned;
+}
+
+/// Gives the pages of a span back to the kernel but keeps it mapped,
+/// they read back as zeros the next time they are touched
+static inline void decommit(void* p, size_t bytes) {
+  madvise(p, bytes, MADV_DONTNEED);
+}
+
+/// One past the highest NUMA node the kernel reports online,
+/// 1 on machines (or kernels) without NUMA
+static inline size_t numa_node_count() {
+  static const size_t count = [] {
+    size_t highest = 0;
+    FILE* f = fopen("/sys/devices/system/node/online", "r");
+    if (f) {
+      // a list of ranges like "0-1,3", only the last number matters
+      unsigned long node;
+      while (fscanf(f, "%lu", &node) == 1) {
+        highest = node > highest ? node : highest;
+        if (fgetc(f) == EOF) break;
+      }
+      fclose(f);
+    }
+    return highest + 1;
+  }();
+  return count;
+}
+
+/// The node of the CPU the calling thread is running on right now.
+/// glibc's getcpu goes through the vDSO, the raw syscall is the fallback
+/// for older libcs and costs a kernel entry
+static inline size_t current_numa_node() {
+  unsigned cpu = 0, node = 0;
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 29)
+  if (getcpu(&cpu, &node)) {
+    return 0;
+  }
+#else
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr)) {
+    return 0;
+  }
+#endif
+  return node;
+}
+
+/// Asks for the pages of a span to come from node when they are next
+/// touched. Pages already backed stay where they are
+static inline void prefer_numa_node(void* p, size_t bytes, size_t node) {
+  unsigned long mask[4] = {};
+  if (node >= sizeof(mask) * 8) {
+    return;
+  }
+  mask[node / 64] = 1ul << (node % 64);
+  syscall(SYS_mbind, p, bytes, MPOL_PREFERRED, mask, sizeof(mask) * 8, 0);
+}
+
+/// Takes slabs straight from mmap, for when malloc itself can't be used.
+/// Every slab is a mapping of its own, so this is for big slabs - small
+/// ones are better carved out of spans (span_source.hpp), or a process
+/// with many of them runs into vm.max_map_count
+struct mmap_slab_source {
+  constexpr static bool shared_slabs = false;
+  constexpr static size_t min_slab_bytes = pool_geometry::min_slab_bytes;
+
+  void* acquire_slab(size_t bytes) { return map_aligned(bytes, bytes); }
+
+  void release_slab(void* s, size_t bytes) { munmap(s, bytes); }
+};
+
+namespace slab_list {
+
+// Slab lists are circular, so head->prev is the bottom of the list
+
+static inline void remove(slab_header* s, slab_header*& head) {
+  if (s->next == s) {
+    head = nullptr;
+    return;
+  }
+  s->prev->next = s->next;
+  s->next->prev = s->prev;
+  if (s == head) {
+    head = s->next;
+  }
+}
+
+static inline void push_back(slab_header* s, slab_header*& head) {
+  if (head) {
+    s->next = head;
+    s->prev = head->prev;
+    head->prev->next = s;
+    head->prev = s;
+  } else {
+    s->next = s->prev = s;
+    head = s;
+  }
+}
+
+static inline void push_front(slab_header* s, slab_header*& head) {
+  push_back(s, head);
+  head = s;
+}
+
+} // namespace slab_list
+
+/// Where a pool gets its slab memory from. acquire_slab returns bytes
+/// bytes aligned to bytes, release_slab gives them back. Pools never ask
+/// for slabs smaller than min_slab_bytes.
+///
+/// A source with shared_slabs set hands slabs between several pools
+/// (see concurrent_pool.hpp). Those pools check the owner of a slab on
+/// eviction, return objects from other pools' slabs through the slab's
+/// remote bitmask, and give slabs back to the source as soon as they are
+/// completely free.
+///
+/// malloc_slab_source, the default, carves slabs out of groups of
+/// group_slots slabs, each group posix_memalign'd to its own size. A
+/// posix_memalign per slab would cost glibc about a slab of padding for
+/// every slab. The first slot of a group holds its slab_group, and only
+/// the first page of that slot is ever touched. A group is freed once all
+/// of its slabs are back, except for one spare kept against churn, and
+/// slabs over max_group_slab bytes are allocated one by one. Slabs are
+/// decommitted a whole group at a time, when the group becomes the spare -
+/// one madvise instead of one per slab, and no page faults for a slab
+/// which is released and acquired again while its group is in use.
+///
+/// The groups are shared by all pools behind a lock, so the source itself
+/// is stateless and may be made on the fly. Only acquiring and releasing
+/// slabs takes the lock
+struct malloc_slab_source {
+  constexpr static bool shared_slabs = false;
+  constexpr static size_t min_slab_bytes = pool_geometry::min_slab_bytes;
+  constexpr static size_t group_slots = pool_geometry::bits_per_word;
+  constexpr static size_t max_group_slab = 64 * 1024;
+
+private:
+
+  // num_open counts the free slots, the list links chain open groups
+  struct slab_group : slab_header {
+    size_t slab_bytes;
+    // slot 0 is the group itself and never set
+    size_t free_mask;
+  };
+
+  struct group_lists {
+    std::mutex lock;
+    slab_header* open = nullptr;
+    slab_group* spare = nullptr;
+  };
+
+  // never destroyed, pools may release slabs from static destructors
+  static group_lists& groups() {
+    static group_lists* g = new group_lists();
+    return *g;
+  }
+
+  static slab_group* open_group(group_lists& g, size_t bytes) {
+    slab_header* s = g.open;
+    if (!s) return nullptr;
+    do {
+      if (static_cast<slab_group*>(s)->slab_bytes == bytes) {
+        return static_cast<slab_group*>(s);
+      }
+      s = s->next;
+    } while (s != g.open);
+    return nullptr;
+  }
+
+  static slab_group* new_group(group_lists& g, size_t bytes) {
+    slab_group* group = g.spare;
+    g.spare = nullptr;
+    if (group && group->slab_bytes != bytes) {
+      ::free(group);
+      group = nullptr;
+    }
+    void* mem;
+    if (!group) {
+      if (posix_memalign(&mem, bytes * group_slots, bytes * group_slots)) {
+        return nullptr;
+      }
+      group = (slab_group*)mem;
+    }
+    group->owner = nullptr;
+    group->num_open = group_slots - 1;
+    group->object_size = 0;
+    group->slab_bytes = bytes;
+    group->free_mask = ~(size_t)1;
+    slab_list::push_front(group, g.open);
+    return group;
+  }
+
+public:
+
+  void* acquire_slab(size_t bytes) {
+    if (bytes > max_group_slab) {
+      void* s;
+      return posix_memalign(&s, bytes, bytes) ? nullptr : s;
+    }
+    group_lists& g = groups();
+    std::lock_guard<std::mutex> guard(g.lock);
+    slab_group* group = open_group(g, bytes);
+    group = group ? group : new_group(g, bytes);
+    if (!group) {
+      return nullptr;
+    }
+    size_t slot = get_and_clear_first_set(&group->free_mask);
+    if (--group->num_open == 0) {
+      slab_list::remove(group, g.open);
+    }
+    return (char*)group + slot * bytes;
+  }
+
+  void release_slab(void* s, size_t bytes) {
+    if (bytes > max_group_slab) {
+      ::free(s);
+      return;
+    }
+    slab_group* group = (slab_group*)((size_t)s & ~(bytes * group_slots - 1));
+    group_lists& g = groups();
+    std::lock_guard<std::mutex> guard(g.lock);
+    group->free_mask = set_bit(group->free_mask,
+                               ((char*)s - (char*)group) / bytes);
+    if (group->num_open++ == 0) {
+      slab_list::push_front(group, g.open);
+    }
+    if (group->num_open == group_slots - 1) {
+      slab_list::remove(group, g.open);
+      ::free(g.spare);
+      // slot 0 keeps the header, new_group reads slab_bytes from it
+      decommit((char*)group + bytes, bytes * (group_slots - 1));
+      g.spare = group;
+    }
+  }
+};
+
+namespace slab_bits {
+
+constexpr size_t all_ones = (0 - 1);
+
+/// The bits of word w which stand for one of the objects
+static inline size_t valid_bits(size_t w, size_t objects) {
+  size_t first = w * pool_geometry::bits_per_word;
+  size_t left = objects > first ? objects - first : 0;
+  return left >= pool_geometry::bits_per_word ? all_ones
+                                              : ((size_t)1 << left) - 1;
+}
+
+/// Marks the first objects open, leaving any spare bits clear
+static inline void init(size_t* words, size_t num_words, size_t objects) {
+  for (size_t i = 0; i < num_words; i++) {
+    words[i] = valid_bits(i, objects);
+  }
+}
+
+static inline size_t first_open_word(const size_t* words, size_t num_words) {
+  return num_words == 1 ? 0 : first_nonzero_word(words, num_words);
+}
+
+/// Clears and returns the index of the first open object
+static inline size_t take_first(size_t* words, size_t num_words) {
+  size_t w = first_open_word(words, num_words);
+  return w * pool_geometry::bits_per_word + get_and_clear_first_set(&words[w]);
+}
+
+/// Clears and returns the index of the open object closest to index,
+/// looking in the word holding index first. The slab must have an
+/// open object
+static inline size_t take_near(size_t* words, size_t num_words,
+                               size_t index) {
+  size_t w = index / pool_geometry::bits_per_word;
+  size_t bit = index % pool_geometry::bits_per_word;
+  size_t word = words[w];
+  if (!word) {
+    return take_first(words, num_words);
+  }
+  size_t low_bits = ((size_t)1 << bit) - 1;
+  size_t above = word & ~low_bits;
+  size_t below = word & low_bits;
+  size_t up = above ? get_first_set(above) : all_ones;
+  size_t down = below ? get_last_set(below) : all_ones;
+  size_t pick = !below || (above && up - bit <= bit - down) ? up : down;
+  words[w] = word & ~((size_t)1 << pick);
+  return w * pool_geometry::bits_per_word + pick;
+}
+
+static inline bool is_set(const size_t* words, size_t index) {
+  return (words[index / pool_geometry::bits_per_word]
+          >> (index % pool_geometry::bits_per_word)) & 1;
+}
+
+static inline void put(size_t* words, size_t index) {
+  size_t& word = words[index / pool_geometry::bits_per_word];
+  word = set_bit(word, index % pool_geometry::bits_per_word);
+}
+
+} // namespace slab_bits
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef SPAN_SOURCE_HPP
+#define SPAN_SOURCE_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "slab.hpp"
+
+/// How spans are backed by huge pages
+enum class huge_pages {
+  none,
+  /// MADV_HUGEPAGE, transparent huge pages when the kernel has them
+  advise,
+  /// MAP_HUGETLB from the reserved pool, falling back to advise
+  hugetlb
+};
+
+/// A slab source which maps large aligned spans and carves slabs out of
+/// them straight from the kernel, with no malloc. Spans are span_bytes and
+/// aligned to it, so a 2 MiB span can sit in a single huge page and the
+/// slabs of one pool share a few TLB entries.
+///
+/// The first slab of every span holds its span_meta, a bitmask of the
+/// free slab slots. Spans with free slots are kept on a circular list and
+/// a span is unmapped as soon as all of its slabs are released, except
+/// for one empty span kept to avoid mapping churn at the boundary.
+/// Slabs aren't decommitted one by one, that would split the huge page
+/// under the span (and MAP_HUGETLB pages can't be decommitted on every
+/// kernel). The spare span is decommitted whole instead, unless it came
+/// from the reserved huge page pool.
+///
+/// One source serves one pool (it's held by value), and isn't thread safe.
+/// Copies are only meant to be made before any slab has been acquired.
+struct span_slab_source {
+  constexpr static bool shared_slabs = false;
+  constexpr static size_t min_slab_bytes = pool_geometry::min_slab_bytes;
+  constexpr static size_t span_bytes = (size_t)2 << 20;
+
+private:
+
+  constexpr static size_t max_slots = span_bytes / min_slab_bytes;
+  constexpr static size_t slot_words = max_slots / pool_geometry::bits_per_word;
+
+  // num_open counts the free slots, the list links chain open spans
+  struct span_meta : slab_header {
+    uint32_t slots;
+    bool hugetlb;
+    size_t free_mask[slot_words];
+  };
+
+  static_assert(sizeof(span_meta) <= min_slab_bytes,
+                "span_meta must fit in the first slab");
+
+  huge_pages mode;
+  slab_header* open_spans = nullptr;
+  span_meta* spare_span = nullptr;
+
+  static span_meta* span_of(void* s) {
+    return (span_meta*)((size_t)s & ~(span_bytes - 1));
+  }
+
+  void* map_span(bool& hugetlb) {
+    hugetlb = false;
+    if (mode == huge_pages::hugetlb) {
+      void* p = mmap(nullptr, span_bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (p != MAP_FAILED) {
+        hugetlb = true;
+        return p;
+      }
+    }
+    void* p = map_aligned(span_bytes, span_bytes);
+    if (p && mode != huge_pages::none) {
+      madvise(p, span_bytes, MADV_HUGEPAGE);
+    }
+    return p;
+  }
+
+  span_meta* new_span(size_t bytes) {
+    span_meta* span = spare_span;
+    spare_span = nullptr;
+    // a decommitted spare reads back false, which it was
+    bool hugetlb = span && span->hugetlb;
+    if (!span) {
+      span = (span_meta*)map_span(hugetlb);
+      if (!span) {
+        return nullptr;
+      }
+    }
+    span->hugetlb = hugetlb;
+    // slot 0 is the span_meta itself
+    span->owner = nullptr;
+    span->slots = span_bytes / bytes;
+    span->num_open = span->slots - 1;
+    span->object_size = 0;
+    slab_bits::init(span->free_mask, slot_words, span->slots);
+    span->free_mask[0] &= ~(size_t)1;
+    slab_list::push_front(span, open_spans);
+    return span;
+  }
+
+  void release_span(span_meta* span) {
+    if (spare_span) {
+      munmap(spare_span, span_bytes);
+    }
+    // the whole span at once keeps a transparent huge page in one piece
+    if (!span->hugetlb) {
+      decommit(span, span_bytes);
+    }
+    spare_span = span;
+  }
+
+public:
+
+  span_slab_source(huge_pages mode_ = huge_pages::advise) : mode(mode_) {}
+
+  span_slab_source(const span_slab_source& other) : mode(other.mode) {}
+
+  span_slab_source& operator=(const span_slab_source&) = delete;
+
+  ~span_slab_source() {
+    // the pool has released everything by now, so only spares are left
+    if (spare_span) {
+      munmap(spare_span, span_bytes);
+    }
+  }
+
+  void* acquire_slab(size_t bytes) {
+    if (bytes > span_bytes / 4) {
+      return map_aligned(bytes, bytes);
+    }
+    span_meta* span = open_spans ? static_cast<span_meta*>(open_spans)
+                                 : new_span(bytes);
+    if (!span) {
+      return nullptr;
+    }
+    size_t slot = slab_bits::take_first(span->free_mask, slot_words);
+    if (--span->num_open == 0) {
+      slab_list::remove(span, open_spans);
+    }
+    return (char*)span + slot * bytes;
+  }
+
+  void release_slab(void* s, size_t bytes) {
+    if (bytes > span_bytes / 4) {
+      munmap(s, bytes);
+      return;
+    }
+    span_meta* span = span_of(s);
+    slab_bits::put(span->free_mask, ((char*)s - (char*)span) / bytes);
+    if (span->num_open++ == 0) {
+      slab_list::push_front(span, open_spans);
+    }
+    if (span->num_open == span->slots - 1) {
+      slab_list::remove(span, open_spans);
+      release_span(span);
+    }
+  }
+};
+
+#endif
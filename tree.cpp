@@ -10,7 +10,7 @@ extern "C" {
 #include "single_list.h"
 }
 
-static unfixed_block single_alloc = create_unfixed_block(sizeof(tree), 64);
+static unfixed_block single_alloc = create_unfixed_block(sizeof(tree), 0);
 constexpr static size_t size_middle = 16000000 / sizeof(tree);
 int32_t num_elems = 0;
 int randn[2049];
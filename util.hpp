@@ -7,39 +7,129 @@
 #define OUT_OF_LINE(block) [&, this]() __attribute__ ((noinline,hot)) block()
 #define OUT_OF_LINE_COLD(block) [&, this]() __attribute__ ((noinline,cold)) block()
 
+#include <stdio.h>
+#include <stdlib.h>
+
+/// Reports a misused pool and stops the program
+__attribute__ ((noinline, cold, noreturn))
+static inline void pool_fault(const char* what, const void* where) {
+    fprintf(stderr, "compacting pool: %s (%p)\n", what, where);
+    abort();
+}
+
+// Building with -DCOMPACTING_POOL_HARDENED turns the asserts on and adds
+// the object checks in pool.hpp (see pool_debug in slab.hpp). Otherwise
+// they compile to nothing
+#if defined(COMPACTING_POOL_HARDENED)
+#define pool_str(x) #x
+#define pool_line(x) pool_str(x)
+#define assert(x) ((x) ? (void)0 : pool_fault( \
+    "assert " #x " failed at " __FILE__ ":" pool_line(__LINE__), nullptr))
+#else
 #define assert(x)
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
+// The bit scans are picked at compile time:
+//
+//  - x86-64 with BMI1 (-mbmi, or -march=haswell and later) uses tzcnt and
+//    blsr. Both read only the original word, so finding and clearing the
+//    lowest bit can issue in parallel instead of the bsf->btr chain.
+//  - Other x86-64 uses bsf/bsr, and btr/bts to flip a single bit.
+//  - aarch64 and everything else use the compiler builtins. On aarch64
+//    ctz is rbit+clz, and clearing the lowest bit is a sub and an and.
+#if defined(__x86_64__) && defined(__BMI__)
+#define BITOPS_BMI1 1
+#define BITOPS_BACKEND "x86-64 bmi1"
+#elif defined(__x86_64__)
+#define BITOPS_X86 1
+#define BITOPS_BACKEND "x86-64"
+#elif defined(__aarch64__)
+#define BITOPS_BACKEND "aarch64"
+#else
+#define BITOPS_BACKEND "builtin"
+#endif
+
+/// Index of the lowest set bit, val must be nonzero
 static inline size_t get_first_set(size_t val) {
+#if defined(BITOPS_X86)
     __asm("bsf %1, %0" : "=r"(val) : "r"(val) :);
     return val;
+#else
+    return __builtin_ctzll(val);
+#endif
+}
+
+/// Index of the highest set bit, val must be nonzero
+static inline size_t get_last_set(size_t val) {
+#if defined(BITOPS_X86)
+    __asm("bsr %1, %0" : "=r"(val) : "r"(val) :);
+    return val;
+#else
+    return 63 - __builtin_clzll(val);
+#endif
 }
 
 static inline size_t get_and_clear_first_set(size_t* dest) {
     size_t oldval = *dest;
     assert(oldval > 0);
+#if defined(BITOPS_X86)
     size_t rval = get_first_set(oldval);
     assert(rval < 64);
-    // On haswell, one can use the clear-lowest-set instruction blsr
-    // which only takes 1 cycle, would have no dependency on
-    // get-first-set, and can execute on a different port.
     __asm("btr %1, %0" : "=r"(oldval) : "r"(rval), "0"(oldval) :);
     assert((oldval & ((size_t)1 << rval)) == 0);
     *dest = oldval;
+#else
+    // tzcnt/blsr, or rbit+clz and sub/and - the clear doesn't
+    // wait for the index
+    size_t rval = get_first_set(oldval);
+    *dest = oldval & (oldval - 1);
+#endif
     return rval;
 }
 
+/// Returns the index of the first nonzero word in a multi-word bitmask.
+/// At least one word must be nonzero. With AVX2, four words are
+/// tested per compare, so a 256 bit mask is a single load and compare
+static inline size_t first_nonzero_word(const size_t* words, size_t num_words) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 4 <= num_words; i += 4) {
+        __m256i vals = _mm256_loadu_si256((const __m256i*)(words + i));
+        __m256i zeros = _mm256_cmpeq_epi64(vals, _mm256_setzero_si256());
+        unsigned nonzero = ~_mm256_movemask_pd(_mm256_castsi256_pd(zeros)) & 0xf;
+        if (nonzero) {
+            return i + __builtin_ctz(nonzero);
+        }
+    }
+#endif
+    while (words[i] == 0) ++i;
+    return i;
+}
+
 static inline size_t set_bit(size_t which, size_t val) {
     assert(val < 64);
     assert((which & ((size_t)1 << val)) == 0);
+#if defined(BITOPS_X86)
     __asm("bts %1, %0" : "=r"(which) : "r"(val), "0"(which) :);
+#else
+    which |= (size_t)1 << val;
+#endif
     assert((which & ((size_t)1 << val)) != 0);
     return which;
-  }
+}
 
 static inline void set_bit_mem(size_t *which, size_t val) {
     assert(val < 64);
     assert((*which & ((size_t)1 << val)) == 0);
-    __asm("bts %1, %0" : "=m"(*which) : "r"(val) :);
+#if defined(BITOPS_X86)
+    __asm("bts %1, %0" : "+m"(*which) : "r"(val) :);
+#else
+    *which |= (size_t)1 << val;
+#endif
     assert((*which & ((size_t)1 << val)) != 0);
 }
 #endif